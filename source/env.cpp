@@ -5,6 +5,10 @@
 #if PLATFORM == PLATFORM_LINUX
 #	include <unistd.h>
 #endif
+#if OS == OS_LINUX || OS == OS_OSX
+#	include <errno.h>
+#	include <sys/stat.h>
+#endif
 
 namespace qm {
 
@@ -277,7 +281,7 @@ void envUpdate(Env& env)
 }
 
 typedef void (*voidFunc)();
-voidFunc queryGlFunc(const char* name)
+voidFunc queryGlFunc(const char* name, bool required)
 {
 	voidFunc f= NULL;
 #if PLATFORM == PLATFORM_LINUX
@@ -287,11 +291,47 @@ voidFunc queryGlFunc(const char* name)
 #elif PLATFORM == PLATFORM_SDL
 	f= (voidFunc)SDL_GL_GetProcAddress(name);
 #endif
-	if (!f) {
+	if (!f && required) {
 		std::printf("Failed to query gl function: %s\n", name);
 		std::abort();
 	}
 	return f;
 }
 
+bool envCacheDir(char* path, std::size_t size)
+{
+#if OS == OS_WINDOWS
+	const char* base= std::getenv("LOCALAPPDATA");
+	if (!base)
+		return false;
+	if ((std::size_t)std::snprintf(path, size, "%s\\qm", base) >= size)
+		return false;
+	return CreateDirectoryA(path, NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+#elif OS == OS_LINUX || OS == OS_OSX
+	const char* home= std::getenv("HOME");
+#	if OS == OS_LINUX
+	const char* xdg_cache= std::getenv("XDG_CACHE_HOME");
+	int len= 0;
+	if (xdg_cache && xdg_cache[0] == '/')
+		len= std::snprintf(path, size, "%s", xdg_cache);
+	else if (home)
+		len= std::snprintf(path, size, "%s/.cache", home);
+	else
+		return false;
+#	else
+	if (!home)
+		return false;
+	int len= std::snprintf(path, size, "%s/Library/Caches", home);
+#	endif
+	if (len < 0 || (std::size_t)len >= size)
+		return false;
+	mkdir(path, 0755); // Parent might not exist yet
+	if ((std::size_t)std::snprintf(path + len, size - len, "/qm") >= size - len)
+		return false;
+	return mkdir(path, 0755) == 0 || errno == EEXIST;
+#else
+	return false;
+#endif
+}
+
 } // qm
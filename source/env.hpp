@@ -80,7 +80,12 @@ void envQuit(Env& env);
 void envUpdate(Env& env);
 
 typedef void (*voidFunc)();
-voidFunc queryGlFunc(const char* name);
+/// @param required Abort if the function isn't available, otherwise return NULL
+voidFunc queryGlFunc(const char* name, bool required= true);
+
+/// Writes path of a per-user cache directory for the program to `path`, creating the directory if needed
+/// @return false if there's no suitable directory
+bool envCacheDir(char* path, std::size_t size);
 
 } // qm
 
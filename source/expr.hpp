@@ -0,0 +1,441 @@
+#ifndef QM_EXPR_HPP
+#define QM_EXPR_HPP
+
+// Expression graph for generating shader code
+// Nodes are created through the `expr*` functions, which fold constants and reuse an
+// existing node for an equal subexpression. Subexpressions used more than once are
+// hoisted to temporaries when printed, so e.g. r or cos(theta) are evaluated only once.
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+#include "util.hpp"
+
+namespace qm {
+
+enum ExprOp {
+	ExprOp_const,
+	ExprOp_var,
+	ExprOp_add,
+	ExprOp_mul,
+	ExprOp_div,
+	ExprOp_sqrt,
+	ExprOp_exp,
+	ExprOp_cos,
+	ExprOp_sin,
+};
+
+struct ExprNode {
+	ExprOp op;
+	int a, b; // Operands, -1 if unused
+	double value; // ExprOp_const
+	char name[24]; // ExprOp_var, any GLSL expression
+	bool hoisted; // Printed as a temporary, set by `appendExprTemporaries`
+};
+
+const std::size_t maxExprNodes= 512;
+struct Expr {
+	StackArray<ExprNode, maxExprNodes> nodes;
+};
+
+inline
+bool isExprConst(const Expr& e, int node, double value)
+{
+	return e.nodes.data[node].op == ExprOp_const && e.nodes.data[node].value == value;
+}
+
+/// @return Index of an equal node, or of `n` appended to `e`
+inline
+int exprNode(Expr& e, ExprNode n)
+{
+	for (std::size_t i= 0; i < e.nodes.size; ++i) {
+		const ExprNode& other= e.nodes.data[i];
+		if (	other.op == n.op && other.a == n.a && other.b == n.b &&
+				std::memcmp(&other.value, &n.value, sizeof(n.value)) == 0 &&
+				std::strcmp(other.name, n.name) == 0)
+			return (int)i;
+	}
+	push(e.nodes, n);
+	return (int)e.nodes.size - 1;
+}
+
+inline
+int exprOp(Expr& e, ExprOp op, int a, int b= -1)
+{
+	ExprNode n= {};
+	n.op= op;
+	n.a= a;
+	n.b= b;
+	return exprNode(e, n);
+}
+
+inline
+int exprConst(Expr& e, double value)
+{
+	ExprNode n= {};
+	n.op= ExprOp_const;
+	n.a= n.b= -1;
+	n.value= value + 0.0; // No negative zero
+	return exprNode(e, n);
+}
+
+inline
+int exprVar(Expr& e, const char* name)
+{
+	ExprNode n= {};
+	n.op= ExprOp_var;
+	n.a= n.b= -1;
+	assert(std::strlen(name) < sizeof(n.name));
+	std::snprintf(n.name, sizeof(n.name), "%s", name);
+	return exprNode(e, n);
+}
+
+inline
+int exprMul(Expr& e, int a, int b)
+{
+	if (e.nodes.data[b].op == ExprOp_const && e.nodes.data[a].op != ExprOp_const)
+		std::swap(a, b); // Constant first
+	const ExprNode na= e.nodes.data[a];
+	const ExprNode nb= e.nodes.data[b];
+	if (na.op == ExprOp_const && nb.op == ExprOp_const)
+		return exprConst(e, na.value*nb.value);
+	if (isExprConst(e, a, 0.0))
+		return a;
+	if (isExprConst(e, a, 1.0))
+		return b;
+	if (	na.op == ExprOp_const && nb.op == ExprOp_mul &&
+			e.nodes.data[nb.a].op == ExprOp_const) // c1*(c2*x) = (c1*c2)*x
+		return exprMul(e, exprConst(e, na.value*e.nodes.data[nb.a].value), nb.b);
+	if (na.op != ExprOp_const) { // (c1*x)*(c2*y) = (c1*c2)*(x*y)
+		const bool a_scaled= na.op == ExprOp_mul && e.nodes.data[na.a].op == ExprOp_const;
+		const bool b_scaled= nb.op == ExprOp_mul && e.nodes.data[nb.a].op == ExprOp_const;
+		if (a_scaled || b_scaled) {
+			const double c= (a_scaled ? e.nodes.data[na.a].value : 1.0)*
+							(b_scaled ? e.nodes.data[nb.a].value : 1.0);
+			return exprMul(e,
+					exprConst(e, c),
+					exprMul(e, a_scaled ? na.b : a, b_scaled ? nb.b : b));
+		}
+	}
+	return a < b || na.op == ExprOp_const ? exprOp(e, ExprOp_mul, a, b) : exprOp(e, ExprOp_mul, b, a);
+}
+
+inline
+int exprAdd(Expr& e, int a, int b)
+{
+	const ExprNode& na= e.nodes.data[a];
+	const ExprNode& nb= e.nodes.data[b];
+	if (na.op == ExprOp_const && nb.op == ExprOp_const)
+		return exprConst(e, na.value + nb.value);
+	if (isExprConst(e, a, 0.0))
+		return b;
+	if (isExprConst(e, b, 0.0))
+		return a;
+	if (a == b)
+		return exprMul(e, exprConst(e, 2.0), a);
+	// Operands in order, so that a + b and b + a are the same node
+	return a < b ? exprOp(e, ExprOp_add, a, b) : exprOp(e, ExprOp_add, b, a);
+}
+
+inline
+int exprDiv(Expr& e, int a, int b)
+{
+	const ExprNode& nb= e.nodes.data[b];
+	if (nb.op == ExprOp_const)
+		return exprMul(e, exprConst(e, 1.0/nb.value), a);
+	if (isExprConst(e, a, 0.0))
+		return a;
+	return exprOp(e, ExprOp_div, a, b);
+}
+
+/// Unary function, evaluated immediately for a constant
+inline
+int exprFunc(Expr& e, ExprOp op, int a)
+{
+	const ExprNode& na= e.nodes.data[a];
+	if (na.op == ExprOp_const) {
+		switch (op) {
+			case ExprOp_sqrt: return exprConst(e, std::sqrt(na.value));
+			case ExprOp_exp: return exprConst(e, std::exp(na.value));
+			case ExprOp_cos: return exprConst(e, std::cos(na.value));
+			case ExprOp_sin: return exprConst(e, std::sin(na.value));
+			default: assert(0 && "Not a unary function");
+		}
+	}
+	return exprOp(e, op, a);
+}
+
+/// x^k by squaring, so that x^2, x^4, ... are shared with other powers of x
+inline
+int exprIntPow(Expr& e, int x, int k)
+{
+	assert(k >= 0);
+	int result= exprConst(e, 1.0);
+	int square= x;
+	for (; k > 0; k /= 2) {
+		if (k % 2)
+			result= exprMul(e, result, square);
+		if (k > 1)
+			square= exprMul(e, square, square);
+	}
+	return result;
+}
+
+/// Sum of coeff[i]*x^i in Horner form
+/// If only even or only odd powers are present, the polynomial is evaluated in x^2.
+inline
+int exprPolynomial(Expr& e, int x, const double* coeff, int count)
+{
+	int degree= -1;
+	int parity_mask= 0;
+	for (int i= 0; i < count; ++i) {
+		if (coeff[i] == 0.0)
+			continue;
+		degree= i;
+		parity_mask |= 1 << (i % 2);
+	}
+	if (degree < 0)
+		return exprConst(e, 0.0);
+
+	const int stride= parity_mask == 3 ? 1 : 2;
+	const int low= parity_mask == 2 ? 1 : 0;
+	const int base= stride == 1 ? x : exprMul(e, x, x);
+	int result= exprConst(e, coeff[degree]);
+	for (int i= degree - stride; i >= low; i -= stride)
+		result= exprAdd(e, exprMul(e, result, base), exprConst(e, coeff[i]));
+	return low ? exprMul(e, result, x) : result;
+}
+
+/// Sum of coeff[i]*x^i*y^(degree - i) in Horner form, given `y2` = y^2
+/// Only powers of the same parity as `degree` are supported, so y is needed only as y^2.
+inline
+int exprHomogeneousPolynomial(Expr& e, int x, int y2, const double* coeff, int degree)
+{
+	assert(degree >= 0);
+	const int x2= exprMul(e, x, x);
+	int result= exprConst(e, coeff[degree]);
+	for (int i= degree - 2; i >= 0; i -= 2) {
+		assert(coeff[i + 1] == 0.0);
+		result= exprAdd(e,
+				exprMul(e, result, x2),
+				exprMul(e, exprConst(e, coeff[i]), exprIntPow(e, y2, (degree - i)/2)));
+	}
+	return degree % 2 ? exprMul(e, result, x) : result;
+}
+
+inline
+void exprComplexMul(Expr& e, int a_re, int a_im, int b_re, int b_im, int* re, int* im)
+{
+	const int minus_one= exprConst(e, -1.0);
+	*re= exprAdd(e, exprMul(e, a_re, b_re), exprMul(e, minus_one, exprMul(e, a_im, b_im)));
+	*im= exprAdd(e, exprMul(e, a_re, b_im), exprMul(e, a_im, b_re));
+}
+
+/// (re + i*im)^k by squaring
+inline
+void exprComplexIntPow(Expr& e, int re, int im, int k, int* result_re, int* result_im)
+{
+	assert(k >= 0);
+	*result_re= exprConst(e, 1.0);
+	*result_im= exprConst(e, 0.0);
+	int square_re= re, square_im= im;
+	for (; k > 0; k /= 2) {
+		if (k % 2)
+			exprComplexMul(e, *result_re, *result_im, square_re, square_im, result_re, result_im);
+		if (k > 1)
+			exprComplexMul(e, square_re, square_im, square_re, square_im, &square_re, &square_im);
+	}
+}
+
+inline
+void appendExprGlsl(String* s, const Expr& e, int node, bool ignore_hoisting= false)
+{
+	const ExprNode& n= e.nodes.data[node];
+	if (n.hoisted && !ignore_hoisting) {
+		append(s, "expr_%i", node);
+		return;
+	}
+
+	const char* func= NULL;
+	switch (n.op) {
+		case ExprOp_const:
+			// Exact enough for float, and always parsed as float in GLSL
+			append(s, n.value < 0.0 ? "(%.8e)" : "%.8e", n.value);
+		return;
+		case ExprOp_var:
+			append(s, "%s", n.name);
+		return;
+		case ExprOp_add: {
+			// a + (-1)*b is printed as a - b
+			const ExprNode& na= e.nodes.data[n.a];
+			const ExprNode& nb= e.nodes.data[n.b];
+			const bool negative_a= na.op == ExprOp_mul && !na.hoisted && isExprConst(e, na.a, -1.0);
+			const bool negative_b= nb.op == ExprOp_mul && !nb.hoisted && isExprConst(e, nb.a, -1.0);
+			const bool swap= negative_a && !negative_b;
+			append(s, "(");
+			appendExprGlsl(s, e, swap ? n.b : n.a);
+			if (swap || negative_b) {
+				append(s, " - ");
+				appendExprGlsl(s, e, swap ? na.b : nb.b);
+			} else {
+				append(s, " + ");
+				appendExprGlsl(s, e, n.b);
+			}
+			append(s, ")");
+		} return;
+		case ExprOp_mul:
+		case ExprOp_div:
+			appendExprGlsl(s, e, n.a);
+			append(s, n.op == ExprOp_mul ? "*" : "/");
+			if (	n.op == ExprOp_div && !e.nodes.data[n.b].hoisted &&
+					(e.nodes.data[n.b].op == ExprOp_mul || e.nodes.data[n.b].op == ExprOp_div)) {
+				append(s, "(");
+				appendExprGlsl(s, e, n.b);
+				append(s, ")");
+			} else {
+				appendExprGlsl(s, e, n.b);
+			}
+		return;
+		case ExprOp_sqrt: func= "sqrt"; break;
+		case ExprOp_exp: func= "exp"; break;
+		case ExprOp_cos: func= "cos"; break;
+		case ExprOp_sin: func= "sin"; break;
+	}
+	append(s, "%s(", func);
+	appendExprGlsl(s, e, n.a);
+	append(s, ")");
+}
+
+/// Appends declarations "float expr_<i>= ...;" of nodes which are used more than once by `roots`
+/// Call before printing `roots` with `appendExprGlsl`.
+inline
+void appendExprTemporaries(String* s, Expr& e, const int* roots, std::size_t root_count)
+{
+	int use_count[maxExprNodes]= {};
+	bool reached[maxExprNodes]= {};
+	for (std::size_t i= 0; i < root_count; ++i)
+		reached[roots[i]]= true;
+	// Operands are always created before the node, so one reverse pass visits users first
+	for (int i= (int)e.nodes.size - 1; i >= 0; --i) {
+		const ExprNode& n= e.nodes.data[i];
+		if (!reached[i])
+			continue;
+		if (n.a >= 0) {
+			reached[n.a]= true;
+			++use_count[n.a];
+		}
+		if (n.b >= 0) {
+			reached[n.b]= true;
+			++use_count[n.b];
+		}
+	}
+
+	for (std::size_t i= 0; i < e.nodes.size; ++i) {
+		ExprNode& n= e.nodes.data[i];
+		n.hoisted= false;
+		if (!reached[i] || use_count[i] < 2 || n.op == ExprOp_const || n.op == ExprOp_var)
+			continue;
+		append(s, "float expr_%i= ", (int)i);
+		appendExprGlsl(s, e, (int)i, true);
+		append(s, ";");
+		n.hoisted= true; // Later nodes refer to the temporary
+	}
+}
+
+/// Evaluates `node` with variables given by `var_value`
+inline
+double evalExpr(const Expr& e, int node, double (*var_value)(const char* name))
+{
+	const ExprNode& n= e.nodes.data[node];
+	switch (n.op) {
+		case ExprOp_const: return n.value;
+		case ExprOp_var: return var_value(n.name);
+		case ExprOp_add: return evalExpr(e, n.a, var_value) + evalExpr(e, n.b, var_value);
+		case ExprOp_mul: return evalExpr(e, n.a, var_value)*evalExpr(e, n.b, var_value);
+		case ExprOp_div: return evalExpr(e, n.a, var_value)/evalExpr(e, n.b, var_value);
+		case ExprOp_sqrt: return std::sqrt(evalExpr(e, n.a, var_value));
+		case ExprOp_exp: return std::exp(evalExpr(e, n.a, var_value));
+		case ExprOp_cos: return std::cos(evalExpr(e, n.a, var_value));
+		case ExprOp_sin: return std::sin(evalExpr(e, n.a, var_value));
+	}
+	return 0.0;
+}
+
+inline
+void testExpr()
+{
+	struct Vars {
+		static double value(const char* name) { return name[0] == 'x' ? 0.7 : -1.3; }
+	};
+
+	Expr e= {};
+	const int x= exprVar(e, "x");
+	const int y= exprVar(e, "y");
+	assert(exprVar(e, "x") == x);
+
+	// Folding
+	assert(isExprConst(e, exprMul(e, exprConst(e, 2.0), exprConst(e, 3.0)), 6.0));
+	assert(exprAdd(e, x, exprConst(e, 0.0)) == x);
+	assert(exprMul(e, exprConst(e, 1.0), x) == x);
+	assert(isExprConst(e, exprMul(e, x, exprConst(e, 0.0)), 0.0));
+	assert(isExprConst(e, exprFunc(e, ExprOp_cos, exprConst(e, 0.0)), 1.0));
+	const int x3= exprMul(e, exprConst(e, 3.0), x);
+	assert(exprMul(e, exprConst(e, 2.0), x3) == exprMul(e, x, exprConst(e, 6.0)));
+	assert(exprMul(e, x3, exprMul(e, y, exprConst(e, 2.0))) == exprMul(e, exprConst(e, 6.0), exprMul(e, x, y)));
+
+	// Sharing
+	assert(exprAdd(e, x, y) == exprAdd(e, y, x));
+	assert(exprMul(e, x, y) == exprMul(e, y, x));
+	const int x8= exprIntPow(e, x, 8);
+	assert(exprIntPow(e, x, 4) == e.nodes.data[x8].a);
+	assert(std::abs(evalExpr(e, exprIntPow(e, x, 7), Vars::value) - std::pow(0.7, 7)) < 1e-15);
+
+	{ // Horner
+		const double coeff[]= { 0.5, 0.0, -2.0, 0.0, 3.0 };
+		const double odd_coeff[]= { 0.0, 1.0, 0.0, 4.0 };
+		const double full_coeff[]= { 1.0, -1.0, 0.25 };
+		const int even= exprPolynomial(e, y, coeff, 5);
+		const int odd= exprPolynomial(e, y, odd_coeff, 4);
+		const int full= exprPolynomial(e, y, full_coeff, 3);
+		const double v= Vars::value("y");
+		assert(std::abs(evalExpr(e, even, Vars::value) - (0.5 - 2.0*v*v + 3.0*v*v*v*v)) < 1e-14);
+		assert(std::abs(evalExpr(e, odd, Vars::value) - (v + 4.0*v*v*v)) < 1e-14);
+		assert(std::abs(evalExpr(e, full, Vars::value) - (1.0 - v + 0.25*v*v)) < 1e-14);
+		assert(isExprConst(e, exprPolynomial(e, y, coeff + 1, 1), 0.0));
+	}
+
+	{ // Complex
+		int re, im;
+		exprComplexIntPow(e, x, y, 5, &re, &im);
+		const double xv= Vars::value("x"), yv= Vars::value("y");
+		const double mag= std::pow(std::sqrt(xv*xv + yv*yv), 5.0);
+		const double arg= 5*std::atan2(yv, xv);
+		assert(std::abs(evalExpr(e, re, Vars::value) - mag*std::cos(arg)) < 1e-14);
+		assert(std::abs(evalExpr(e, im, Vars::value) - mag*std::sin(arg)) < 1e-14);
+
+		const double coeff[]= { 0.0, 2.0, 0.0, -3.0 };
+		const int hom= exprHomogeneousPolynomial(e, x, exprMul(e, y, y), coeff, 3);
+		const double correct= 2.0*xv*yv*yv - 3.0*xv*xv*xv;
+		assert(std::abs(evalExpr(e, hom, Vars::value) - correct) < 1e-14);
+	}
+
+	{ // Printing
+		const int r= exprFunc(e, ExprOp_sqrt, exprAdd(e, exprMul(e, x, x), exprMul(e, y, y)));
+		const int roots[]= { exprDiv(e, x, r), exprDiv(e, y, r) };
+		String s= createString();
+		appendExprTemporaries(&s, e, roots, 2);
+		append(&s, "a= ");
+		appendExprGlsl(&s, e, roots[0]);
+		assert(!std::strstr(std::strstr(s.str, "sqrt(") + 1, "sqrt(")); // Evaluated once
+		assert(std::strstr(s.str, "a= x/expr_"));
+		appendExprGlsl(&s, e, exprAdd(e, exprMul(e, exprConst(e, -1.0), x), y));
+		assert(std::strstr(s.str, "(y - x)"));
+		destroyString(s);
+	}
+}
+
+} // qm
+
+#endif // QM_EXPR_HPP
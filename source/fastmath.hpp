@@ -0,0 +1,300 @@
+#ifndef QM_FASTMATH_HPP
+#define QM_FASTMATH_HPP
+
+// Approximations of elementary functions, interchangeable with libm in CPU kernels
+// Functions are branchless (selects only) and free of table lookups, so that they can be
+// inlined into loops. They aren't faster than libm: with GCC, at -O2 and also at
+// -O3 -fno-trapping-math, the wave function kernels take 5-40% longer with them,
+// so the program uses libm (`StdMath`) and `FastMath` is only instantiated by the tests.
+// Error bounds are verified against libm in `testFastMath`.
+
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <inttypes.h>
+
+namespace qm {
+
+const double fastMathPi= 3.14159265358979311600e+00;
+
+// Integer conversions are done with the 1.5*2^52 "magic number" and bit operations,
+// because conversions between 64-bit integer and double don't vectorize before AVX-512
+const double fastMathMagic= 6755399441055744.0;
+
+/// Rounds to nearest integer for |x| < 2^51 without a call to libm
+/// @note Relies on strict IEEE arithmetic, i.e. no -ffast-math
+inline
+double fastRound(double x)
+{
+	return (x + fastMathMagic) - fastMathMagic;
+}
+
+/// 2^round(x) for x in [-1022, 1023], constructed from bits
+inline
+double fastExp2i(double x)
+{
+	// Low bits of the mantissa of the shifted value contain round(x)
+	const double shifted= x + fastMathMagic;
+	uint64_t bits;
+	std::memcpy(&bits, &shifted, sizeof(bits));
+	bits= (bits + 1023) << 52; // Unsigned, as the high bits of the magic number are shifted out
+	double result;
+	std::memcpy(&result, &bits, sizeof(result));
+	return result;
+}
+
+/// e^x, max relative error 1e-14 for x in [-708, 709]
+/// Returns 0 below -708 (no denormals)
+inline
+double fastExp(double x)
+{
+	const double ln2_hi= 6.93147180369123816490e-01;
+	const double ln2_lo= 1.90821492927058770002e-10;
+	const double log2e= 1.44269504088896338700e+00;
+
+	const double clamped= x < -708.0 ? -708.0 : x > 709.0 ? 709.0 : x;
+	const double k= fastRound(clamped*log2e);
+	const double r= (clamped - k*ln2_hi) - k*ln2_lo; // |r| <= ln(2)/2
+
+	// Taylor polynomial of degree 11
+	double p= 1.0/39916800;
+	p= p*r + 1.0/3628800;
+	p= p*r + 1.0/362880;
+	p= p*r + 1.0/40320;
+	p= p*r + 1.0/5040;
+	p= p*r + 1.0/720;
+	p= p*r + 1.0/120;
+	p= p*r + 1.0/24;
+	p= p*r + 1.0/6;
+	p= p*r + 0.5;
+	p= p*r + 1.0;
+	p= p*r + 1.0;
+
+	const double result= p*fastExp2i(k);
+	return x < -708.0 ? 0.0 : result;
+}
+
+/// Natural logarithm, max absolute error 1e-15*(1 + |log(x)|) for x in [1e-300, 1e300]
+/// @note x <= 0 and non-finite x are not supported
+inline
+double fastLog(double x)
+{
+	const double ln2= 6.93147180559945286227e-01;
+	const double sqrt2= 1.41421356237309514547e+00;
+
+	// x = mantissa*2^e, mantissa in [1, 2)
+	int64_t bits;
+	std::memcpy(&bits, &x, sizeof(bits));
+	int64_t exp_bits= (int64_t)((uint64_t)bits >> 52) | 0x4330000000000000LL; // 2^52 + biased exponent
+	double e;
+	std::memcpy(&e, &exp_bits, sizeof(e));
+	e -= 4503599627370496.0 + 1023.0;
+	bits= (bits & 0x000fffffffffffffLL) | 0x3ff0000000000000LL;
+	double mantissa;
+	std::memcpy(&mantissa, &bits, sizeof(mantissa));
+
+	// Mantissa to [sqrt(0.5), sqrt(2))
+	const bool big= mantissa > sqrt2;
+	mantissa= big ? mantissa*0.5 : mantissa;
+	e= big ? e + 1.0 : e;
+
+	// log(m) = 2*atanh(s), s = (m - 1)/(m + 1), |s| <= 0.1716
+	const double s= (mantissa - 1.0)/(mantissa + 1.0);
+	const double s2= s*s;
+	double p= 1.0/19;
+	p= p*s2 + 1.0/17;
+	p= p*s2 + 1.0/15;
+	p= p*s2 + 1.0/13;
+	p= p*s2 + 1.0/11;
+	p= p*s2 + 1.0/9;
+	p= p*s2 + 1.0/7;
+	p= p*s2 + 1.0/5;
+	p= p*s2 + 1.0/3;
+	p= p*s2 + 1.0;
+	return 2.0*s*p + e*ln2;
+}
+
+/// x^y for x >= 0, max relative error 1e-14*(1 + |y*log(x)|)
+/// pow(0, y) is 1 for y == 0, and 0 otherwise
+inline
+double fastPow(double x, double y)
+{
+	const double result= fastExp(y*fastLog(x > 0.0 ? x : 1.0));
+	return x > 0.0 ? result : (y == 0.0 ? 1.0 : 0.0);
+}
+
+/// sin(x) and cos(x), max absolute error 1e-15*(1 + |x|) for |x| < 1e6
+inline
+void fastSinCos(double x, double* sin_result, double* cos_result)
+{
+	// Cody-Waite reduction to r = x - k*pi/2, |r| <= pi/4
+	const double two_over_pi= 6.36619772367581382433e-01;
+	const double pio2_hi= 1.57079632673412561417e+00;
+	const double pio2_lo= 6.07710050650619224932e-11;
+	const double k= fastRound(x*two_over_pi);
+	const double r= (x - k*pio2_hi) - k*pio2_lo;
+	const double r2= r*r;
+
+	// Taylor polynomials of degree 15 and 16
+	double s= -1.0/1307674368000;
+	s= s*r2 + 1.0/6227020800;
+	s= s*r2 - 1.0/39916800;
+	s= s*r2 + 1.0/362880;
+	s= s*r2 - 1.0/5040;
+	s= s*r2 + 1.0/120;
+	s= s*r2 - 1.0/6;
+	s= s*r2 + 1.0;
+	s *= r;
+
+	double c= 1.0/20922789888000;
+	c= c*r2 - 1.0/87178291200;
+	c= c*r2 + 1.0/479001600;
+	c= c*r2 - 1.0/3628800;
+	c= c*r2 + 1.0/40320;
+	c= c*r2 - 1.0/720;
+	c= c*r2 + 1.0/24;
+	c= c*r2 - 0.5;
+	c= c*r2 + 1.0;
+
+	// Quadrant k mod 4, as floor(k/4) = round((k - 1.5)/4) for integer k
+	const double q= k - 4.0*fastRound((k - 1.5)*0.25);
+	const bool swap= q == 1.0 || q == 3.0;
+	const double sin_v= swap ? c : s;
+	const double cos_v= swap ? s : c;
+	*sin_result= q >= 2.0 ? -sin_v : sin_v;
+	*cos_result= q == 1.0 || q == 2.0 ? -cos_v : cos_v;
+}
+
+inline
+double fastSin(double x)
+{
+	double s, c;
+	fastSinCos(x, &s, &c);
+	return s;
+}
+
+inline
+double fastCos(double x)
+{
+	double s, c;
+	fastSinCos(x, &s, &c);
+	return c;
+}
+
+/// atan2(y, x), max absolute error 1e-14
+/// Returns 0 for (0, 0)
+inline
+double fastAtan2(double y, double x)
+{
+	const double abs_x= std::abs(x);
+	const double abs_y= std::abs(y);
+	const double big= abs_x > abs_y ? abs_x : abs_y;
+	const double small= abs_x > abs_y ? abs_y : abs_x;
+	const double t= big > 0.0 ? small/big : 0.0; // [0, 1]
+
+	// atan(t) = pi/6 + atan((t - 1/sqrt(3))/(1 + t/sqrt(3))) reduces to |t| <= tan(pi/12)
+	const double inv_sqrt3= 5.77350269189625731059e-01;
+	const bool shift= t > 0.26794919243112270;
+	const double u= shift ? (t - inv_sqrt3)/(1.0 + t*inv_sqrt3) : t;
+	const double u2= u*u;
+
+	// Taylor polynomial of degree 21
+	double p= 1.0/21;
+	p= -p*u2 + 1.0/19;
+	p= -p*u2 + 1.0/17;
+	p= -p*u2 + 1.0/15;
+	p= -p*u2 + 1.0/13;
+	p= -p*u2 + 1.0/11;
+	p= -p*u2 + 1.0/9;
+	p= -p*u2 + 1.0/7;
+	p= -p*u2 + 1.0/5;
+	p= -p*u2 + 1.0/3;
+	p= -p*u2 + 1.0;
+	double a= u*p + (shift ? fastMathPi/6 : 0.0);
+
+	// Octant
+	a= abs_y > abs_x ? fastMathPi/2 - a : a;
+	a= x < 0.0 ? fastMathPi - a : a;
+	return y < 0.0 ? -a : a;
+}
+
+/// acos(x) for x in [-1, 1], max absolute error 1e-14
+inline
+double fastAcos(double x)
+{
+	return fastAtan2(std::sqrt((1.0 - x)*(1.0 + x)), x);
+}
+
+/// Elementary functions of libm, for templates parameterized by math implementation
+struct StdMath {
+	static double exp(double x) { return std::exp(x); }
+	static double pow(double x, double y) { return std::pow(x, y); }
+	static double acos(double x) { return std::acos(x); }
+	static double atan2(double y, double x) { return std::atan2(y, x); }
+	static void sinCos(double x, double* s, double* c) { *s= std::sin(x); *c= std::cos(x); }
+};
+
+/// Approximations of this file, interchangeable with StdMath
+struct FastMath {
+	static double exp(double x) { return fastExp(x); }
+	static double pow(double x, double y) { return fastPow(x, y); }
+	static double acos(double x) { return fastAcos(x); }
+	static double atan2(double y, double x) { return fastAtan2(y, x); }
+	static void sinCos(double x, double* s, double* c) { fastSinCos(x, s, c); }
+};
+
+inline
+void testFastMath()
+{
+	for (int i= 0; i <= 10000; ++i) { // exp
+		const double x= -708.0 + 1417.0*i/10000;
+		const double correct= std::exp(x);
+		assert(std::abs(fastExp(x) - correct) <= 1e-14*correct);
+	}
+	assert(fastExp(-1000.0) == 0.0);
+
+	for (int i= 1; i <= 10000; ++i) { // log
+		const double x= std::pow(10.0, -300.0 + 600.0*i/10000);
+		assert(std::abs(fastLog(x) - std::log(x)) <= 1e-15*(1.0 + std::abs(std::log(x))));
+		const double y= 1.0 + 1e-6*i;
+		assert(std::abs(fastLog(y) - std::log(y)) <= 1e-15);
+	}
+
+	for (int i= 0; i <= 1000; ++i) { // pow
+		const double x= 0.01*i;
+		for (int y= 0; y < 12; ++y) {
+			const double correct= std::pow(x, y);
+			const double log_mag= x > 0.0 ? std::abs(y*std::log(x)) : 0.0;
+			assert(std::abs(fastPow(x, y) - correct) <= 1e-14*(1.0 + log_mag)*correct);
+		}
+	}
+	assert(fastPow(0.0, 0.0) == 1.0);
+	assert(fastPow(0.0, 3.0) == 0.0);
+
+	for (int i= -10000; i <= 10000; ++i) { // sin, cos
+		const double x= 0.01*i*i*(i < 0 ? -1 : 1);
+		double s, c;
+		fastSinCos(x, &s, &c);
+		assert(std::abs(s - std::sin(x)) <= 1e-15*(1.0 + std::abs(x)));
+		assert(std::abs(c - std::cos(x)) <= 1e-15*(1.0 + std::abs(x)));
+	}
+
+	for (int i= 0; i < 1000; ++i) { // atan2
+		const double angle= 2*fastMathPi*i/1000;
+		for (int k= 0; k < 5; ++k) {
+			const double r= std::pow(10.0, k - 2);
+			const double y= r*std::sin(angle), x= r*std::cos(angle);
+			assert(std::abs(fastAtan2(y, x) - std::atan2(y, x)) <= 1e-14);
+		}
+	}
+	assert(fastAtan2(0.0, 0.0) == 0.0);
+
+	for (int i= 0; i <= 10000; ++i) { // acos
+		const double x= -1.0 + 2.0*i/10000;
+		assert(std::abs(fastAcos(x) - std::acos(x)) <= 1e-14);
+	}
+}
+
+} // qm
+
+#endif // QM_FASTMATH_HPP
@@ -1,6 +1,9 @@
 #ifndef QM_GL_HPP
 #define QM_GL_HPP
 
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include "env.hpp"
 #if OS == OS_WINDOWS || OS == OS_LINUX
 #	include <GL/gl.h>
@@ -20,6 +23,12 @@ namespace qm {
 #define GL_VERTEX_SHADER 0x8B31
 #define GL_COMPILE_STATUS 0x8B81
 #define GL_LINK_STATUS 0x8B82
+#define GL_TEXTURE_3D 0x806F
+#define GL_TEXTURE_WRAP_R 0x8072
+#define GL_CLAMP_TO_EDGE 0x812F
+#define GL_TEXTURE0 0x84C0
+#define GL_TEXTURE1 0x84C1
+#define GL_TEXTURE2 0x84C2
 
 typedef char GLchar;
 typedef intptr_t GLsizeiptr;
@@ -57,6 +66,8 @@ typedef GLint (*GlGetUniformLocation)(GLuint, const GLchar*);
 GlGetUniformLocation glGetUniformLocation;
 typedef void (*GlUniform1f)(GLuint, GLfloat);
 GlUniform1f glUniform1f;
+typedef void (*GlUniform2f)(GLuint, GLfloat, GLfloat);
+GlUniform2f glUniform2f;
 typedef void (*GlUniform3f)(GLuint, GLfloat, GLfloat, GLfloat);
 GlUniform3f glUniform3f;
 typedef void (*GlUniform4f)(GLuint, GLfloat, GLfloat, GLfloat, GLfloat);
@@ -65,6 +76,14 @@ typedef void (*GlUniformMatrix4fv)(GLint, GLsizei, GLboolean, const GLfloat*);
 GlUniformMatrix4fv glUniformMatrix4fv;
 typedef void (*GlUniform1i)(GLint, GLint);
 GlUniform1i glUniform1i;
+typedef void (*GlUniform1fv)(GLint, GLsizei, const GLfloat*);
+GlUniform1fv glUniform1fv;
+typedef void (*GlUniform1iv)(GLint, GLsizei, const GLint*);
+GlUniform1iv glUniform1iv;
+typedef void (*GlUniform2fv)(GLint, GLsizei, const GLfloat*);
+GlUniform2fv glUniform2fv;
+typedef void (*GlUniform4fv)(GLint, GLsizei, const GLfloat*);
+GlUniform4fv glUniform4fv;
 typedef void (*GlGenBuffers)(GLsizei, GLuint*);
 GlGenBuffers glGenBuffers;
 typedef void (*GlBindBuffer)(GLenum, GLuint);
@@ -81,12 +100,17 @@ typedef void (*GlVertexAttribPointer)(GLuint, GLint, GLenum, GLboolean, GLsizei,
 GlVertexAttribPointer glVertexAttribPointer;
 typedef void (*GlBindAttribLocation)(GLuint program, GLuint index, const GLchar *name);
 GlBindAttribLocation glBindAttribLocation;
+typedef void (*GlTexImage3D)(GLenum, GLint, GLint, GLsizei, GLsizei, GLsizei, GLint, GLenum, GLenum, const GLvoid*);
+GlTexImage3D glTexImage3D;
+typedef void (*GlActiveTexture)(GLenum);
+GlActiveTexture glActiveTexture;
 
 
 // Required GL 3 features
 
 #define GL_FRAMEBUFFER 0x8D40
 #define GL_COLOR_ATTACHMENT0 0x8CE0
+#define GL_RGBA32F 0x8814
 
 typedef void (*GlGenFramebuffers)(GLsizei, GLuint*);
 GlGenFramebuffers glGenFramebuffers;
@@ -97,6 +121,91 @@ GlFramebufferTexture2D glFramebufferTexture2D;
 typedef void (*GlDeleteFramebuffers)(GLsizei, GLuint*);
 GlDeleteFramebuffers glDeleteFramebuffers;
 
+inline
+bool hasGlExtension(const char* name)
+{
+	const char* ext= (const char*)glGetString(GL_EXTENSIONS);
+	const std::size_t len= std::strlen(name);
+	while (ext && (ext= std::strstr(ext, name))) {
+		if (ext[len] == ' ' || ext[len] == '\0')
+			return true;
+		ext += len;
+	}
+	return false;
+}
+
+// Optional GL_ARB_get_program_binary (core in GL 4.1)
+
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+
+typedef void (*GlGetProgramBinary)(GLuint, GLsizei, GLsizei*, GLenum*, void*);
+GlGetProgramBinary glGetProgramBinary;
+typedef void (*GlProgramBinary)(GLuint, GLenum, const void*, GLsizei);
+GlProgramBinary glProgramBinary;
+typedef void (*GlProgramParameteri)(GLuint, GLenum, GLint);
+GlProgramParameteri glProgramParameteri;
+
+/// Directory where linked programs are stored, empty if program binaries aren't used
+char g_programBinaryDir[512];
+/// Binaries are valid only for the same driver
+uint64_t g_programBinaryDriverHash;
+
+/// Enables storing linked programs to `dir` and loading them in `createGlShaderProgram`,
+/// if the driver supports program binaries. Only programs given a binary name are stored,
+/// one file per name, so the directory doesn't grow with the number of compiled sources
+inline
+void initProgramBinaryCache(const char* dir)
+{
+	g_programBinaryDir[0]= '\0';
+	if (!hasGlExtension("GL_ARB_get_program_binary"))
+		return;
+
+	glGetProgramBinary= (GlGetProgramBinary)queryGlFunc("glGetProgramBinary", false);
+	glProgramBinary= (GlProgramBinary)queryGlFunc("glProgramBinary", false);
+	glProgramParameteri= (GlProgramParameteri)queryGlFunc("glProgramParameteri", false);
+	GLint format_count= 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &format_count);
+	if (!glGetProgramBinary || !glProgramBinary || !glProgramParameteri || format_count == 0)
+		return;
+
+	const GLenum driver_strings[]= { GL_VENDOR, GL_RENDERER, GL_VERSION };
+	uint64_t hash= hashFnv1a(NULL, 0);
+	for (std::size_t i= 0; i < sizeof(driver_strings)/sizeof(*driver_strings); ++i) {
+		const char* str= (const char*)glGetString(driver_strings[i]);
+		if (str)
+			hash= hashFnv1a(str, std::strlen(str) + 1, hash);
+	}
+	g_programBinaryDriverHash= hash;
+	std::snprintf(g_programBinaryDir, sizeof(g_programBinaryDir), "%s", dir);
+}
+
+// Optional GL_KHR_parallel_shader_compile
+
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+
+typedef void (*GlMaxShaderCompilerThreadsKHR)(GLuint);
+GlMaxShaderCompilerThreadsKHR glMaxShaderCompilerThreadsKHR;
+
+/// Driver compiles and links on its own threads, see `isGlShaderProgramReady`
+bool g_parallelShaderCompile;
+
+inline
+void initParallelShaderCompile()
+{
+	g_parallelShaderCompile= false;
+	if (!hasGlExtension("GL_KHR_parallel_shader_compile"))
+		return;
+
+	glMaxShaderCompilerThreadsKHR=
+		(GlMaxShaderCompilerThreadsKHR)queryGlFunc("glMaxShaderCompilerThreadsKHR", false);
+	if (!glMaxShaderCompilerThreadsKHR)
+		return;
+	glMaxShaderCompilerThreadsKHR(0xFFFFFFFF); // Implementation-defined count
+	g_parallelShaderCompile= true;
+}
+
 inline
 void queryGlFuncs()
 {
@@ -116,10 +225,15 @@ void queryGlFuncs()
 	glDeleteProgram= (GlDeleteProgram)queryGlFunc("glDeleteProgram");
 	glGetUniformLocation= (GlGetUniformLocation)queryGlFunc("glGetUniformLocation");
 	glUniform1f= (GlUniform1f)queryGlFunc("glUniform1f");
+	glUniform2f= (GlUniform2f)queryGlFunc("glUniform2f");
 	glUniform3f= (GlUniform3f)queryGlFunc("glUniform3f");
 	glUniform4f= (GlUniform4f)queryGlFunc("glUniform4f");
 	glUniformMatrix4fv= (GlUniformMatrix4fv)queryGlFunc("glUniformMatrix4fv");
 	glUniform1i= (GlUniform1i)queryGlFunc("glUniform1i");
+	glUniform1fv= (GlUniform1fv)queryGlFunc("glUniform1fv");
+	glUniform1iv= (GlUniform1iv)queryGlFunc("glUniform1iv");
+	glUniform2fv= (GlUniform2fv)queryGlFunc("glUniform2fv");
+	glUniform4fv= (GlUniform4fv)queryGlFunc("glUniform4fv");
 	glGenBuffers= (GlGenBuffers)queryGlFunc("glGenBuffers");
 	glBindBuffer= (GlBindBuffer)queryGlFunc("glBindBuffer");
 	glBufferData= (GlBufferData)queryGlFunc("glBufferData");
@@ -128,6 +242,8 @@ void queryGlFuncs()
 	glEnableVertexAttribArray= (GlEnableVertexAttribArray)queryGlFunc("glEnableVertexAttribArray");
 	glVertexAttribPointer= (GlVertexAttribPointer)queryGlFunc("glVertexAttribPointer");
 	glBindAttribLocation= (GlBindAttribLocation)queryGlFunc("glBindAttribLocation");
+	glTexImage3D= (GlTexImage3D)queryGlFunc("glTexImage3D");
+	glActiveTexture= (GlActiveTexture)queryGlFunc("glActiveTexture");
 
 	glGenFramebuffers= (GlGenFramebuffers)queryGlFunc("glGenFramebuffers");
 	glBindFramebuffer= (GlBindFramebuffer)queryGlFunc("glBindFramebuffer");
@@ -171,42 +287,175 @@ void checkGlErrors(const char* tag)
 		std::printf("GL Error (%s): %i\n", tag, error);
 }
 
+/// Header of a program binary file, followed by the binary
+struct ProgramBinaryHeader {
+	uint64_t hash; // Of sources and driver
+	uint32_t format;
+	uint32_t length;
+};
+
 inline
-void createGlShaderProgram(	GLuint& prog, GLuint& vs, GLuint& fs,
+void programBinaryPath(char* path, std::size_t size, const char* name)
+{
+	std::snprintf(path, size, "%s/%s.bin", g_programBinaryDir, name);
+}
+
+/// @return Linked program, or 0 if the binary of `name` is missing or has been linked
+///         from other sources or by another driver than `hash` specifies
+inline
+GLuint loadProgramBinary(const char* name, uint64_t hash)
+{
+	char path[sizeof(g_programBinaryDir) + 32];
+	programBinaryPath(path, sizeof(path), name);
+	FILE* file= std::fopen(path, "rb");
+	if (!file)
+		return 0;
+
+	GLuint prog= 0;
+	ProgramBinaryHeader header;
+	if (std::fread(&header, sizeof(header), 1, file) == 1 && header.hash == hash) {
+		void* data= std::malloc(header.length);
+		if (data && std::fread(data, 1, header.length, file) == header.length) {
+			prog= glCreateProgram();
+			glProgramBinary(prog, header.format, data, header.length);
+			GLint link_status;
+			glGetProgramiv(prog, GL_LINK_STATUS, &link_status);
+			if (!link_status) { // E.g. driver update
+				glDeleteProgram(prog);
+				prog= 0;
+			}
+		}
+		std::free(data);
+	}
+	std::fclose(file);
+	return prog;
+}
+
+/// Replaces the previous binary of `name`
+inline
+void saveProgramBinary(GLuint prog, const char* name, uint64_t hash)
+{
+	GLint length= 0;
+	glGetProgramiv(prog, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return;
+
+	ProgramBinaryHeader header= { hash, 0, (uint32_t)length };
+	void* data= std::malloc(length);
+	if (!data)
+		return;
+	glGetProgramBinary(prog, length, NULL, &header.format, data);
+
+	char path[sizeof(g_programBinaryDir) + 32];
+	programBinaryPath(path, sizeof(path), name);
+	if (FILE* file= std::fopen(path, "wb")) {
+		std::fwrite(&header, sizeof(header), 1, file);
+		std::fwrite(data, 1, length, file);
+		std::fclose(file);
+	}
+	std::free(data);
+}
+
+/// Starts linking a program from sources without waiting for the result, or loads it from
+/// the program binary cache if it has been linked before (see `initProgramBinaryCache`)
+/// Must be followed by `finishGlShaderProgram`, see `isGlShaderProgramReady` for not blocking.
+/// @note `vs` and `fs` are 0 for a program loaded from a binary
+/// @param binary_hash Sources and driver, for saving the binary in `finishGlShaderProgram`, 0 if not saved
+/// @param binary_name File name in the program binary cache, NULL to not store the program.
+///                    Meant for the fixed set of programs created at every start, as each
+///                    name keeps only the latest binary
+inline
+void startGlShaderProgram(	GLuint& prog, GLuint& vs, GLuint& fs, uint64_t& binary_hash,
+							const char* binary_name,
 							GLsizei vs_count, const GLchar** vs_src,
 							GLsizei fs_count, const GLchar** fs_src)
 {
-	{ // Vertex
-		vs= glCreateShader(GL_VERTEX_SHADER);
-		glShaderSource(vs, vs_count, vs_src, NULL);
-		glCompileShader(vs);
-		checkShaderStatus(vs);
+	binary_hash= 0;
+	const bool use_binaries= binary_name && g_programBinaryDir[0] != '\0';
+	if (use_binaries) {
+		uint64_t hash= g_programBinaryDriverHash;
+		for (GLsizei i= 0; i < vs_count; ++i)
+			hash= hashFnv1a(vs_src[i], std::strlen(vs_src[i]), hash);
+		hash= hashFnv1a("\0", 1, hash); // Separate stages
+		for (GLsizei i= 0; i < fs_count; ++i)
+			hash= hashFnv1a(fs_src[i], std::strlen(fs_src[i]), hash);
+
+		prog= loadProgramBinary(binary_name, hash);
+		if (prog) {
+			vs= fs= 0;
+			return;
+		}
+		binary_hash= hash;
 	}
-	{ // Fragment
-		fs= glCreateShader(GL_FRAGMENT_SHADER);
-		glShaderSource(fs, fs_count, fs_src, NULL);
-		glCompileShader(fs);
+
+	// Statuses are queried in `finishGlShaderProgram`, so that the driver can compile in the background
+	vs= glCreateShader(GL_VERTEX_SHADER);
+	glShaderSource(vs, vs_count, vs_src, NULL);
+	glCompileShader(vs);
+
+	fs= glCreateShader(GL_FRAGMENT_SHADER);
+	glShaderSource(fs, fs_count, fs_src, NULL);
+	glCompileShader(fs);
+
+	prog= glCreateProgram();
+	glAttachShader(prog, vs);
+	glAttachShader(prog, fs);
+	glBindAttribLocation(prog, 0, "a_pos");
+	glBindAttribLocation(prog, 1, "a_uv");
+	if (use_binaries)
+		glProgramParameteri(prog, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	glLinkProgram(prog);
+}
+
+/// @return True if `finishGlShaderProgram` wouldn't block
+/// Always true without GL_KHR_parallel_shader_compile.
+inline
+bool isGlShaderProgramReady(GLuint prog)
+{
+	if (!g_parallelShaderCompile)
+		return true;
+	GLint completed= GL_FALSE;
+	glGetProgramiv(prog, GL_COMPLETION_STATUS_KHR, &completed);
+	return completed == GL_TRUE;
+}
+
+/// Waits for a program started with `startGlShaderProgram`, and aborts if it failed
+inline
+void finishGlShaderProgram(GLuint prog, GLuint vs, GLuint fs, uint64_t binary_hash, const char* binary_name)
+{
+	if (vs)
+		checkShaderStatus(vs);
+	if (fs)
 		checkShaderStatus(fs);
-	}
-	{ // Shader program
-		prog= glCreateProgram();
-		glAttachShader(prog, vs);
-		glAttachShader(prog, fs);
-		glBindAttribLocation(prog, 0, "a_pos");
-		glBindAttribLocation(prog, 1, "a_uv");
-		glLinkProgram(prog);
-		checkProgramStatus(prog);
-	}
+	checkProgramStatus(prog);
+
+	if (binary_hash)
+		saveProgramBinary(prog, binary_name, binary_hash);
+}
+
+inline
+void createGlShaderProgram(	GLuint& prog, GLuint& vs, GLuint& fs,
+							GLsizei vs_count, const GLchar** vs_src,
+							GLsizei fs_count, const GLchar** fs_src,
+							const char* binary_name= NULL)
+{
+	uint64_t binary_hash;
+	startGlShaderProgram(prog, vs, fs, binary_hash, binary_name, vs_count, vs_src, fs_count, fs_src);
+	finishGlShaderProgram(prog, vs, fs, binary_hash, binary_name);
 }
 
 inline
 void destroyGlShaderProgram(GLuint prog, GLuint vs, GLuint fs)
 {
-	glDetachShader(prog, vs);
-	glDeleteShader(vs);
+	if (vs) {
+		glDetachShader(prog, vs);
+		glDeleteShader(vs);
+	}
 
-	glDetachShader(prog, fs);
-	glDeleteShader(fs);
+	if (fs) {
+		glDetachShader(prog, fs);
+		glDeleteShader(fs);
+	}
 
 	glDeleteProgram(prog);
 }
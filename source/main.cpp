@@ -1,11 +1,18 @@
 // See unity.cpp for build instructions
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <mutex>
+#include <thread>
+#include <utility>
 
 #include "env.hpp"
+#include "expr.hpp"
+#include "fastmath.hpp"
 #include "fontdata.hpp"
 #include "gl.hpp"
 #include "math.hpp"
@@ -48,13 +55,63 @@ struct Slider {
 
 struct VolumeShader {
 	GLuint vs, fs, prog;
+	uint64_t binaryHash; // See `startGlShaderProgram`
+	const char* binaryName;
+	bool linked; // False while the driver is compiling in the background
+	bool generic; // Takes `VolumeParams` as uniforms
 	GLint timeLoc;
 	GLint phaseLoc;
 	GLint colorLoc;
 	GLint transformLoc;
 	GLint rayLengthLoc;
+	GLint boundsLoc;
+	GLint skipEmptySpaceLoc;
+	GLint occupancyLoc;
+	GLint gridMinLoc;
+	GLint gridSizeLoc;
+	GLint densityLoc;
+	GLint densityMaxLoc;
+	GLint sampleFractionLoc;
+	GLint interferenceLoc; // Molecule only, so that the source doesn't depend on the integrals
+	GLint moleculeNLoc;
+
+	// Generic shader only
+	GLint sampleCountLoc;
+	GLint complexColorLoc;
+	GLint absorptionLoc;
+	GLint cutoffLoc;
+	GLint visualAmplitudeLoc;
+	GLint symmetryLoc;
+	GLint waveCountLoc;
+	GLint moleculeLoc;
+	GLint normalizationLoc;
+	GLint rhoMulLoc;
+	GLint lLoc;
+	GLint absMLoc;
+	GLint mLoc;
+	GLint wavePhaseLoc;
+	GLint wavePhasorLoc;
+	GLint translationLoc;
+	GLint laguerreCoeffLoc;
+	GLint legendreCoeffLoc;
+	GLint waveLookupLoc; // -1 unless the waves are looked up, see `genericVolumeFsSource`
+	GLint lookupScaleLoc;
 };
 
+const std::size_t Program_volumeShaderCacheSize= 16;
+
+/// Linked volume shader programs, least recently used is replaced first
+struct VolumeShaderCache {
+	struct Entry {
+		uint64_t hash; // Of fragment shader source
+		uint64_t lastUse;
+		VolumeShader shader;
+	};
+	StackArray<Entry, Program_volumeShaderCacheSize> entries;
+	uint64_t useCount;
+};
+
+/// Floating point, so that frames can be averaged in it
 struct VolumeFbo {
 	GLuint fboId;
 	GLuint texId;
@@ -75,20 +132,129 @@ struct GuiShader {
 	GLint colorLoc;
 };
 
+/// See `resolveFsSrc`
+struct ResolveShader {
+	GLuint vs, fs, prog;
+	GLint currentLoc;
+	GLint historyLoc;
+	GLint transformLoc;
+	GLint historyTransformLoc;
+	GLint texelSizeLoc;
+	GLint currentWeightLoc;
+	GLint reprojectLoc;
+};
+
 struct QuadVbo {
 	GLuint vboId;
 };
 
+/// Intermediate representation for hydrogen wave function calculation
+const std::size_t maxHPolyTermCount= maxPolyTermCount;
+const int orbitalCdfSize= 256;
+const std::size_t orbitalExtentCacheSize= 16;
+const int electronSamplerTableSize= 4096;
+const std::size_t electronSamplerChunkSize= 1 << 16;
+const int maxSamplerThreadCount= 64;
+constexpr double bohrRadius= 1.0;
+struct HWaveFunc {
+	// Hydrogen wave function |nlm> in four parts
+	// psi_nlm(r, theta, phi) = A*C*E*L*Y, where
+	//   C = normalization factor sqrt[(2/(n*a_0))^3*(n - l - 1)!/(2n(n + l)!)]
+	//   E = e^(-rho/l)*rho^l
+	//   L = Generalized Laguerre Polynomial L(n - l - 1, 2l + 1, rho)
+	//   Y = Spherical harmonic function Y(l, m, theta, phi)
+	//   rho = 2r/(n*a_0)
+	double normalization; // C
+	double laguerreCoeff[maxHPolyTermCount]; // Coefficients for rho^n in L(rho)
+	double spheCoeff[maxHPolyTermCount]; // Coefficients for cos(theta)^n in Y(theta) (missing complex phase ofc)
+	double phase; // Addition to complex phase in Y
+	int n;
+	int l;
+	int m;
+};
+
 const std::size_t Program_maxSliders= 32;
+/// Static view converges after this many frames, and isn't rendered again until it changes
+const int Program_maxAccumulatedFrames= 256;
+/// While the view rotates with `Program::reproject` set, frames are rendered with a fraction
+/// of the samples and blended to the reprojected history with a fixed weight
+const float Program_motionSampleFraction= 0.25;
+const float Program_motionFrameWeight= 0.5;
 const std::size_t Program_maxWaves= 2;
+const int Program_maxSampleCount= 150;
+
+/// Max n supported by the generic volume shader
+const int genericShaderMaxN= 12;
+
+/// Scene parameters of the volume shader, besides the per-frame uniforms
+/// Baked into the source of a specialized shader, and uploaded as uniforms to the generic one
+struct VolumeParams {
+	int sampleCount;
+	bool complexColor;
+	float absorption;
+	float cutoff;
+	float visualAmplitude;
+	bool h2Symmetry;
+	HWaveFunc waves[Program_maxWaves];
+	float translations[Program_maxWaves];
+	std::size_t waveCount;
+	bool molecule;
+	Complex interference; // <psi_1|psi_2>, for molecule
+	double moleculeN; // Normalization factor, for molecule
+	float bounds[Program_maxWaves][4]; // Bounding sphere of each wave, center and radius
+	float gridMin[3]; // Corner of the occupancy grid, which is the bounding box of `bounds`
+	float gridSize[3];
+};
+
+/// CPU side of updating the volume for new slider values, computed on a worker thread
+/// so that the frame doesn't stall, see `startVolumeUpdate`
+/// Textures are NULL if they are current or not used
+struct VolumeUpdate {
+	std::thread thread; // Joinable while the update is in progress
+	std::atomic<bool> done;
+	float sampling, precompute, genericShader; // Slider values when started
+	VolumeParams params;
+	bool wavesChanged; // Bounds and integrals of `params` are new, see `sameWaves`
+	bool gridChanged; // Occupancy grid of the previous params is out of date
+	unsigned char* occupancy; // See `computeOccupancyGrid`
+	unsigned short* density; // See `computeDensityTexture`
+	double densityMax;
+	unsigned short* waveLookup; // See `computeWaveLookup`
+	float waveLookupScale[Program_maxWaves];
+};
+
 struct Program {
-	VolumeShader shader;
-	VolumeFbo fbo;
+	VolumeShader shader; // Owned by `shaderCache`
+	VolumeShader* pendingShader; // Replaces `shader` when linked, points to `shaderCache`
+	VolumeShaderCache shaderCache;
+	VolumeFbo fbo; // Volume of the current frame, see `resolveFsSrc`
+	VolumeFbo historyFbos[2]; // Resolved frames, the latest at `historyIndex`
+	int historyIndex;
+	float historyTransform[16]; // View of the latest resolved frame
+	int accumulatedFrames; // Averaged in the history since the view stopped, 0 to start over
+	uint64_t accumulationColorHash; // Colors of the history
+	GLuint occupancyTexId; // See `computeOccupancyGrid`
+	GLuint densityTexId; // See `computeDensityTexture`, updated only when `precompute` is 2
+	float densityMax; // Returned by `computeDensityTexture`
+	GLuint waveLookupTexId; // See `computeWaveLookup`, updated only when `precompute` is 1
+	float waveLookupScale[Program_maxWaves]; // Returned by `computeWaveLookup`
+	float occupancySampling; // `sampling` of the occupancy grid, 0 if the grid doesn't match `volumeParams`
+	bool densityCurrent; // Density texture matches `volumeParams`
+	bool waveLookupCurrent; // Wave lookup texture matches `volumeParams`
+	VolumeUpdate volumeUpdate; // Replaces `volumeParams` and the textures when done
 	Font font;
 	GuiShader guiShader;
+	ResolveShader resolveShader;
 	QuadVbo vbo;
 	float time;
 
+	/// Recompiles requested by slider changes are coalesced while dragging
+	float recompileInterval; // Min seconds between recompiles during a drag
+	float timeSinceRecompile;
+	bool recompileRequested;
+	int speculationSlider; // Last changed integer recompile slider, -1 if none
+	int speculationStep; // Next neighbour value to precompile: 0 for -1, 1 for +1, 2 when done
+
 	/// Slider settings
 	struct Wave {
 		float phase; /// Additional factor: e^(i*phase)
@@ -106,31 +272,19 @@ struct Program {
 	float distance;
 	float brightness;
 	float h2Symmetry; // bool
+	float genericShader; // bool
+	float sampling; // 0: evenly along the ray, 1: skip empty cells, 2: also adapt the step to the cells
+	float precompute; // 0: evaluate the waves, 1: wave lookup texture, 2: density texture. Overrides `genericShader`
+	float reproject; // bool, reuse the history while the view rotates, see `resolveFsSrc`
+	VolumeParams volumeParams;
 	StackArray<Wave, Program_maxWaves> waves;
 	StackArray<Slider, Program_maxSliders> sliders;
 };
 
-/// Intermediate representation for hydrogen wave function calculation
-const std::size_t maxHPolyTermCount= 30;
-const double bohrRadius= 1.0;
-struct HWaveFunc {
-	// Hydrogen wave function |nlm> in four parts
-	// psi_nlm(r, theta, phi) = A*C*E*L*Y, where
-	//   C = normalization factor sqrt[(2/(n*a_0))^3*(n - l - 1)!/(2n(n + l)!)]
-	//   E = e^(-rho/l)*rho^l
-	//   L = Generalized Laguerre Polynomial L(n - l - 1, 2l + 1, rho)
-	//   Y = Spherical harmonic function Y(l, m, theta, phi)
-	//   rho = 2r/(n*a_0)
-	double normalization; // C
-	double laguerreCoeff[maxHPolyTermCount]; // Coefficients for rho^n in L(rho)
-	double spheCoeff[maxHPolyTermCount]; // Coefficients for cos(theta)^n in Y(theta) (missing complex phase ofc)
-	double phase; // Addition to complex phase in Y
-	int n;
-	int l;
-	int m;
-};
 
-HWaveFunc createHWaveFunc(int n, int l, int m, double phase)
+/// Coefficients are looked up from the tables in math.hpp, so this can be
+/// used also in constant expressions
+constexpr HWaveFunc createHWaveFunc(int n, int l, int m, double phase)
 {
 	assert(n > 0 && l >= 0);
 	if (l > n - 1)
@@ -145,77 +299,740 @@ HWaveFunc createHWaveFunc(int n, int l, int m, double phase)
 	w.l= l;
 	w.m= m;
 	w.phase= phase;
-	w.normalization= std::sqrt(	std::pow(2.0/(n*bohrRadius), 3)*
+	const double a= 2.0/(n*bohrRadius);
+	w.normalization= constSqrt(	a*a*a*
 								fact(n - l - 1)/(2*n*fact(n + l)));
 
-	assert(n - l < (int)maxHPolyTermCount);
-	laguerre(w.laguerreCoeff, n - l - 1, 2*l + 1);
+	assert(n < (int)maxHPolyTermCount);
+	hydrogenLaguerre(w.laguerreCoeff, n, l);
 
-	assert(l - 1 < (int)maxHPolyTermCount);
-	sphericalHarmonics(w.spheCoeff, l, m);
+	assert(l < (int)maxHPolyTermCount);
+	sphericalHarmonicsLookup(w.spheCoeff, l, m);
 
 	return w;
 }
 
+/// Evaluates psi_nlm (including the phase factor) at `count` Cartesian points
+/// rho^l*Y is evaluated as (2/(n*a_0))^l*r^l*Y, where r^l*Y is a polynomial of x, y and z,
+/// so no trigonometric functions are needed
+/// @tparam Math StdMath or FastMath
+template <typename Math>
+void hWaveFuncBatch(
+		Complex* result, const HWaveFunc* w,
+		const double* x, const double* y, const double* z, int count)
+{
+	const SolidHarmonic solid= createSolidHarmonic(w->spheCoeff, w->l, w->m);
+	const double rho_mul= 2.0/(w->n*bohrRadius);
+	double radial_mul= w->normalization; // C*(2/(n*a_0))^l
+	for (int i= 0; i < w->l; ++i)
+		radial_mul *= rho_mul;
+	const Complex phase= { std::cos(w->phase), std::sin(w->phase) };
+
+	for (int begin= 0; begin < count; begin += batchBlockSize) {
+		const int size= count - begin < batchBlockSize ? count - begin : batchBlockSize;
+		double rho[batchBlockSize];
+		double radial[batchBlockSize];
+		for (int j= 0; j < size; ++j) {
+			const int i= begin + j;
+			rho[j]= rho_mul*std::sqrt(x[i]*x[i] + y[i]*y[i] + z[i]*z[i]);
+		}
+		// L
+		laguerreBatch(radial, rho, size, w->n - w->l - 1, 2*w->l + 1);
+		// C*E
+		for (int j= 0; j < size; ++j)
+			radial[j] *= radial_mul*Math::exp(-0.5*rho[j]);
+		// Y
+		Complex* out= result + begin;
+		solidHarmonicsBatch(out, solid, x + begin, y + begin, z + begin, size);
+		for (int j= 0; j < size; ++j) {
+			Complex value= { out[j].a*radial[j], out[j].b*radial[j] };
+			out[j]= value*phase;
+		}
+	}
+}
+
+/// Horner evaluation of Poly::coeff(I) ... Poly::coeff(Poly::degree), unrolled at compile time
+template <typename Poly, int I= 0, bool Last= (I >= Poly::degree)>
+struct UnrolledHorner {
+	static double eval(double x)
+	{
+		constexpr double c= Poly::coeff(I);
+		return c + x*UnrolledHorner<Poly, I + 1>::eval(x);
+	}
+};
+
+template <typename Poly, int I>
+struct UnrolledHorner<Poly, I, true> {
+	static double eval(double)
+	{
+		constexpr double c= Poly::coeff(I);
+		return c;
+	}
+};
+
+/// sum_j Poly::coeff(j)*u^(degree - j)*s^j, unrolled at compile time
+template <typename Poly, int J= 1, bool Done= (J > Poly::degree)>
+struct UnrolledHomogeneousHorner {
+	static double eval(double acc, double s_pow, double u, double s)
+	{
+		constexpr double c= Poly::coeff(J);
+		return UnrolledHomogeneousHorner<Poly, J + 1>::eval(acc*u + c*s_pow*s, s_pow*s, u, s);
+	}
+};
+
+template <typename Poly, int J>
+struct UnrolledHomogeneousHorner<Poly, J, true> {
+	static double eval(double acc, double, double, double) { return acc; }
+};
+
+/// (a + ib)^P, unrolled at compile time
+template <int P>
+struct UnrolledComplexPow {
+	static Complex eval(Complex c)
+	{
+		return UnrolledComplexPow<P - 1>::eval(c)*c;
+	}
+};
+
+template <>
+struct UnrolledComplexPow<0> {
+	static Complex eval(Complex) { Complex one= { 1.0, 0.0 }; return one; }
+};
+
+template <int N, int L>
+struct HLaguerrePoly {
+	static const int degree= N - L - 1;
+	static constexpr double coeff(int i) { return laguerreTable.coeff[N][L][i]; }
+};
+
+/// Coefficients of `SolidHarmonic` for Y(L, M)
+template <int L, int M>
+struct HSolidPoly {
+	static const int degree= (L - (M < 0 ? -M : M))/2;
+	static constexpr double coeff(int j)
+	{
+		const int abs_m= M < 0 ? -M : M;
+		const double m_sign= M >= 0 && M % 2 ? -1 : 1;
+		return m_sign*sphericalHarmonicsTable.coeff[L][abs_m][L - abs_m - 2*j];
+	}
+};
+
+/// Same as `hWaveFuncBatch`, but with the quantum numbers fixed at compile time
+/// Only the phase is read from `w`
+template <typename Math, int N, int L, int M>
+void hWaveFuncKernel(
+		Complex* result, const HWaveFunc* w,
+		const double* x, const double* y, const double* z, int count)
+{
+	constexpr HWaveFunc func= createHWaveFunc(N, L, M, 0.0);
+	static_assert(func.l == L && func.m == M, "Invalid quantum numbers");
+	constexpr double rho_mul= 2.0/(N*bohrRadius);
+	const Complex phase= { std::cos(w->phase), std::sin(w->phase) };
+	const int abs_m= M < 0 ? -M : M;
+	const double m_sign= M < 0 ? -1.0 : 1.0;
+	typedef HSolidPoly<L, M> Solid;
+	constexpr double solid_first= Solid::coeff(0);
+
+	double c_l= func.normalization; // C*(2/(n*a_0))^l
+	for (int i= 0; i < L; ++i)
+		c_l *= rho_mul;
+
+	for (int i= 0; i < count; ++i) {
+		const double z2= z[i]*z[i];
+		const double r2= x[i]*x[i] + y[i]*y[i] + z2;
+		const double rho= rho_mul*std::sqrt(r2);
+		const double radial=
+			c_l*Math::exp(-0.5*rho)*UnrolledHorner<HLaguerrePoly<N, L> >::eval(rho);
+
+		double poly= UnrolledHomogeneousHorner<Solid>::eval(solid_first, 1.0, z2, r2);
+		if ((L - abs_m) % 2)
+			poly *= z[i];
+		const Complex xy= { x[i], m_sign*y[i] };
+		const Complex azimuthal= UnrolledComplexPow<abs_m>::eval(xy);
+
+		const double amplitude= radial*poly;
+		const Complex value= { azimuthal.a*amplitude, azimuthal.b*amplitude };
+		result[i]= value*phase;
+	}
+}
+
+typedef void (*HWaveFuncBatchFunc)(
+		Complex*, const HWaveFunc*,
+		const double*, const double*, const double*, int);
+
+/// Kernels are specialized for every |nlm> with n <= hWaveKernelMaxN
+const int hWaveKernelMaxN= 5;
+const int hWaveKernelCount= hWaveKernelMaxN*(hWaveKernelMaxN + 1)*(2*hWaveKernelMaxN + 1)/6;
+
+/// |nlm> are indexed in order of n, l, m
+constexpr int hWaveKernelIndex(int n, int l, int m)
+{ return (n - 1)*n*(2*n - 1)/6 + l*l + l + m; }
+
+constexpr int hWaveKernelN(int index)
+{
+	int n= 1;
+	while (hWaveKernelIndex(n + 1, 0, 0) <= index)
+		++n;
+	return n;
+}
+
+constexpr int hWaveKernelL(int index)
+{
+	const int n= hWaveKernelN(index);
+	int l= 0;
+	while (l + 1 < n && hWaveKernelIndex(n, l + 1, -(l + 1)) <= index)
+		++l;
+	return l;
+}
+
+constexpr int hWaveKernelM(int index)
+{
+	const int n= hWaveKernelN(index);
+	const int l= hWaveKernelL(index);
+	return index - hWaveKernelIndex(n, l, 0);
+}
+
+template <typename Math, int... I>
+HWaveFuncBatchFunc lookupHWaveFuncKernel(int index, std::integer_sequence<int, I...>)
+{
+	static const HWaveFuncBatchFunc kernels[]= {
+		&hWaveFuncKernel<Math, hWaveKernelN(I), hWaveKernelL(I), hWaveKernelM(I)>...
+	};
+	return kernels[index];
+}
+
+template <typename Math>
+HWaveFuncBatchFunc lookupHWaveFuncKernel(const HWaveFunc* w)
+{
+	if (w->n > hWaveKernelMaxN)
+		return hWaveFuncBatch<Math>;
+	return lookupHWaveFuncKernel<Math>(
+			hWaveKernelIndex(w->n, w->l, w->m),
+			std::make_integer_sequence<int, hWaveKernelCount>());
+}
+
+/// Evaluates psi_nlm at Cartesian points with a specialized kernel if there is one
+/// for the quantum numbers, and with the generic `hWaveFuncBatch` otherwise
+void evalHWaveFunc(
+		Complex* result, const HWaveFunc* w,
+		const double* x, const double* y, const double* z, int count)
+{
+	HWaveFuncBatchFunc kernel= lookupHWaveFuncKernel<StdMath>(w);
+	kernel(result, w, x, y, z, count);
+}
+
+inline
+void testHWaveFunc()
+{
+	const int count= 16;
+	double x[count], y[count], z[count];
+	for (int i= 0; i < count; ++i) {
+		x[i]= 0.7*i - 3.0;
+		y[i]= 0.3*i*(i % 3 - 1);
+		z[i]= 5.0 - 0.9*i;
+	}
+
+	for (int n= 1; n <= hWaveKernelMaxN; ++n) {
+		for (int l= 0; l < n; ++l) {
+			for (int m= -l; m <= l; ++m) {
+				HWaveFunc w= createHWaveFunc(n, l, m, 0.5);
+				Complex generic[count], specialized[count];
+				hWaveFuncBatch<StdMath>(generic, &w, x, y, z, count);
+				evalHWaveFunc(specialized, &w, x, y, z, count);
+				for (int i= 0; i < count; ++i) {
+					assert(std::abs(generic[i].a - specialized[i].a) < 1e-9);
+					assert(std::abs(generic[i].b - specialized[i].b) < 1e-9);
+				}
+				lookupHWaveFuncKernel<FastMath>(&w)(specialized, &w, x, y, z, count);
+				for (int i= 0; i < count; ++i) {
+					assert(std::abs(generic[i].a - specialized[i].a) < 1e-9);
+					assert(std::abs(generic[i].b - specialized[i].b) < 1e-9);
+				}
+			}
+		}
+	}
+}
+
+/// Where an orbital |nlm> lives: nodal surfaces and the radial probability distribution
+struct OrbitalExtent {
+	int n, l, m;
+	StackArray<double, maxHPolyTermCount> radialNodes; // Radii of spherical nodes, ascending
+	StackArray<double, maxHPolyTermCount> angularNodes; // Theta of conical nodes in (0, pi), ascending
+	double cdfMaxR; // Radius of the last entry in `cdf`
+	double cdf[orbitalCdfSize]; // Probability enclosed within r= cdfMaxR*i/(orbitalCdfSize - 1)
+};
+
+/// Finds sign changes of f on a grid of `steps` intervals in (begin, end) and refines them with bisection
+template <typename F>
+void findRoots(StackArray<double, maxHPolyTermCount>& roots, F f, double begin, double end, int steps)
+{
+	roots.size= 0;
+	double prev_x= begin;
+	double prev_f= f(begin);
+	for (int i= 1; i <= steps; ++i) {
+		const double x= begin + (end - begin)*i/steps;
+		const double fx= f(x);
+		if (fx == 0.0) {
+			if (i < steps)
+				push(roots, x);
+		} else if (prev_f != 0.0 && (prev_f < 0.0) != (fx < 0.0)) {
+			double a= prev_x, b= x;
+			for (int k= 0; k < 60; ++k) {
+				const double mid= 0.5*(a + b);
+				if ((f(mid) < 0.0) == (prev_f < 0.0))
+					a= mid;
+				else
+					b= mid;
+			}
+			push(roots, 0.5*(a + b));
+		}
+		prev_x= x;
+		prev_f= fx;
+	}
+}
+
+/// Radius beyond which the radial probability density is negligible
+/// Density r^2*R^2 ~ rho^(2l + 2)*e^(-rho)*L^2 is a mixture of gamma distributions
+/// with mean below 3n, so rho = 8n + 40 leaves out a negligible tail
+double radialDensityMaxR(int n)
+{ return (8.0*n + 40.0)*n*bohrRadius/2.0; }
+
+/// Unnormalized radial probability density r^2*R^2 at `count` radii evenly spaced in [0, radialDensityMaxR(n)]
+void radialProbabilityDensity(double* result, int count, int n, int l)
+{
+	assert(count > 1);
+	const double max_rho= 2.0*radialDensityMaxR(n)/(n*bohrRadius);
+	for (int i= 0; i < count; ++i)
+		result[i]= max_rho*i/(count - 1);
+	laguerreBatch(result, result, count, n - l - 1, 2*l + 1);
+	for (int i= 0; i < count; ++i) {
+		const double rho= max_rho*i/(count - 1);
+		result[i]= std::pow(rho, 2*l + 2)*std::exp(-rho)*result[i]*result[i];
+	}
+}
+
+OrbitalExtent createOrbitalExtent(int n, int l, int m)
+{
+	assert(n > 0 && l >= 0 && l < n && std::abs(m) <= l);
+	OrbitalExtent e= {};
+	e.n= n;
+	e.l= l;
+	e.m= m;
+	const int k= n - l - 1;
+	const double alpha= 2*l + 1;
+	const double rho_to_r= n*bohrRadius/2.0;
+
+	// Zeros of L(k, alpha, rho) are in (0, 4k + 2alpha + 2)
+	findRoots(e.radialNodes, [=](double rho) {
+			double value;
+			laguerreBatch(&value, &rho, 1, k, alpha);
+			return value;
+		}, 0.0, 4*k + 2*alpha + 2, 4096);
+	assert((int)e.radialNodes.size == k);
+	for (std::size_t i= 0; i < e.radialNodes.size; ++i)
+		e.radialNodes.data[i] *= rho_to_r;
+
+	// Zeros of P(l, |m|, cos(theta)) excluding the poles
+	const double dtheta= pi/4096;
+	findRoots(e.angularNodes, [=](double theta) {
+			double value= std::cos(theta);
+			associatedLegendreBatch(&value, &value, 1, l, std::abs(m));
+			return value;
+		}, dtheta, pi - dtheta, 4096);
+	assert((int)e.angularNodes.size == l - std::abs(m));
+
+	const int sub_steps= 4;
+	const int steps= (orbitalCdfSize - 1)*sub_steps;
+	double density[(orbitalCdfSize - 1)*sub_steps + 1];
+	radialProbabilityDensity(density, steps + 1, n, l);
+	double sum= 0.0;
+	e.cdf[0]= 0.0;
+	for (int i= 1; i <= steps; ++i) {
+		sum += 0.5*(density[i - 1] + density[i]);
+		if (i % sub_steps == 0)
+			e.cdf[i/sub_steps]= sum;
+	}
+	for (int i= 0; i < orbitalCdfSize; ++i)
+		e.cdf[i] /= sum;
+	e.cdfMaxR= radialDensityMaxR(n);
+
+	return e;
+}
+
+/// Cached `createOrbitalExtent`
+/// Returns a copy, as the cache is shared with the thread of `startVolumeUpdate`
+OrbitalExtent orbitalExtent(int n, int l, int m)
+{
+	local_persist StackArray<OrbitalExtent, orbitalExtentCacheSize> cache;
+	local_persist std::size_t next_replaced;
+	local_persist std::mutex mutex;
+	std::lock_guard<std::mutex> lock(mutex);
+	for (std::size_t i= 0; i < cache.size; ++i) {
+		const OrbitalExtent& e= cache.data[i];
+		if (e.n == n && e.l == l && e.m == m)
+			return e;
+	}
+
+	if (cache.size < orbitalExtentCacheSize) {
+		push(cache, createOrbitalExtent(n, l, m));
+		return last(cache);
+	}
+	OrbitalExtent& replaced= cache.data[next_replaced];
+	next_replaced= (next_replaced + 1) % orbitalExtentCacheSize;
+	return replaced= createOrbitalExtent(n, l, m);
+}
+
+OrbitalExtent orbitalExtent(const HWaveFunc* w)
+{ return orbitalExtent(w->n, w->l, w->m); }
+
+/// Radius of the sphere which contains `fraction` of the probability
+double enclosingRadius(const OrbitalExtent& e, double fraction)
+{
+	assert(fraction >= 0.0 && fraction <= 1.0);
+	int i= 1;
+	while (i < orbitalCdfSize - 1 && e.cdf[i] < fraction)
+		++i;
+	const double span= e.cdf[i] - e.cdf[i - 1];
+	const double t= span > 0.0 ? (fraction - e.cdf[i - 1])/span : 0.0;
+	return e.cdfMaxR*(i - 1 + t)/(orbitalCdfSize - 1);
+}
+
+inline
+void testOrbitalExtent()
+{
+	{ // 3s
+		const OrbitalExtent& e= orbitalExtent(3, 0, 0);
+		assert(e.radialNodes.size == 2 && e.angularNodes.size == 0);
+		assert(std::abs(e.radialNodes.data[0] - (9.0 - 3.0*std::sqrt(3.0))/2) < 1e-9);
+		assert(std::abs(e.radialNodes.data[1] - (9.0 + 3.0*std::sqrt(3.0))/2) < 1e-9);
+	}
+
+	{ // 3d0
+		const OrbitalExtent& e= orbitalExtent(3, 2, 0);
+		assert(e.radialNodes.size == 0 && e.angularNodes.size == 2);
+		assert(std::abs(e.angularNodes.data[0] - std::acos(1/std::sqrt(3.0))) < 1e-9);
+		assert(std::abs(e.angularNodes.data[1] - std::acos(-1/std::sqrt(3.0))) < 1e-9);
+		assert(orbitalExtent(3, 2, 1).angularNodes.size == 1);
+	}
+
+	{ // 1s, P(r < R) = 1 - e^(-2R)*(1 + 2R + 2R^2)
+		const OrbitalExtent& e= orbitalExtent(1, 0, 0);
+		for (int i= 1; i < 10; ++i) {
+			const double r= enclosingRadius(e, 0.1*i);
+			const double p= 1.0 - std::exp(-2*r)*(1 + 2*r + 2*r*r);
+			assert(std::abs(p - 0.1*i) < 1e-3);
+		}
+	}
+
+	for (int n= 1; n < (int)maxHPolyTermCount; n += 7) {
+		for (int l= 0; l < n; l += 3) {
+			const OrbitalExtent& e= orbitalExtent(n, l, -l);
+			assert((int)e.radialNodes.size == n - l - 1 && (int)e.angularNodes.size == 0);
+			assert(enclosingRadius(e, 0.5) < enclosingRadius(e, 0.99));
+		}
+	}
+}
+
+/// Cumulative tables for drawing electron positions from |psi_nlm|^2 by inverse transform sampling
+/// r, cos(theta) and phi are independent: |psi|^2 dV = r^2*R(r)^2 dr * P(l, |m|, cos(theta))^2 dcos(theta) * dphi
+/// Radii of `rCdf` are spaced quadratically, so that the inner shells of large n get as fine bins
+/// as the outer ones relative to their size
+struct ElectronSampler {
+	double rCdf[electronSamplerTableSize]; // P(r < maxR*(i/(size - 1))^2)
+	double cosThetaCdf[electronSamplerTableSize]; // P(cos(theta) < -1 + 2i/(size - 1))
+	double maxR; // Encloses all but 1e-9 of the probability
+};
+
+/// Normalizes running trapezoidal sums of `density` to a cumulative table with cdf[0] = 0, cdf[size - 1] = 1
+void cumulate(double* cdf, const double* density, int size)
+{
+	double sum= 0.0;
+	cdf[0]= 0.0;
+	for (int i= 1; i < size; ++i) {
+		sum += 0.5*(density[i - 1] + density[i]);
+		cdf[i]= sum;
+	}
+	for (int i= 0; i < size; ++i)
+		cdf[i] /= sum;
+}
+
+/// Inverse of a piecewise linear cumulative table, as a fraction of the table range
+double inverseCdf(const double* cdf, int size, double u)
+{
+	int low= 0, high= size - 1; // cdf[low] <= u <= cdf[high]
+	while (high - low > 1) {
+		const int mid= (low + high)/2;
+		if (cdf[mid] < u)
+			low= mid;
+		else
+			high= mid;
+	}
+	const double span= cdf[high] - cdf[low];
+	const double t= span > 0.0 ? (u - cdf[low])/span : 0.5;
+	return (low + t)/(size - 1);
+}
+
+void initElectronSampler(ElectronSampler* s, const HWaveFunc* w)
+{
+	const int size= electronSamplerTableSize;
+	double density[electronSamplerTableSize];
+
+	// r^2*R^2 ~ rho^(2l + 2)*e^(-rho)*L^2, integrated over the uneven radii
+	s->maxR= enclosingRadius(orbitalExtent(w), 1.0 - 1e-9);
+	const double max_rho= 2.0*s->maxR/(w->n*bohrRadius);
+	for (int i= 0; i < size; ++i) {
+		const double f= (double)i/(size - 1);
+		density[i]= max_rho*f*f;
+	}
+	laguerreBatch(density, density, size, w->n - w->l - 1, 2*w->l + 1);
+	s->rCdf[0]= 0.0;
+	for (int i= 0; i < size; ++i) {
+		const double f= (double)i/(size - 1);
+		const double rho= max_rho*f*f;
+		density[i]= std::pow(rho, 2*w->l + 2)*std::exp(-rho)*density[i]*density[i];
+		if (i > 0) {
+			const double prev_f= (double)(i - 1)/(size - 1);
+			s->rCdf[i]= s->rCdf[i - 1] + 0.5*(density[i - 1] + density[i])*(f*f - prev_f*prev_f);
+		}
+	}
+	for (int i= 0; i < size; ++i)
+		s->rCdf[i] /= s->rCdf[size - 1];
+
+	for (int i= 0; i < size; ++i)
+		density[i]= -1.0 + 2.0*i/(size - 1);
+	associatedLegendreBatch(density, density, size, w->l, std::abs(w->m));
+	for (int i= 0; i < size; ++i)
+		density[i] *= density[i];
+	cumulate(s->cosThetaCdf, density, size);
+}
+
+/// Writes `count` positions as xyz triplets to `xyz`. Draws are done in chunks of
+/// `electronSamplerChunkSize` with an own random stream each, so the result depends
+/// only on `seed`, and not on `thread_count`
+void sampleElectronPositions(
+		float* xyz, std::size_t count,
+		const ElectronSampler* s, uint64_t seed, int thread_count)
+{
+	assert(thread_count > 0 && thread_count <= maxSamplerThreadCount);
+	const std::size_t chunk_count= (count + electronSamplerChunkSize - 1)/electronSamplerChunkSize;
+	const int size= electronSamplerTableSize;
+
+	auto work= [=](int thread_i) {
+		for (std::size_t chunk= thread_i; chunk < chunk_count; chunk += thread_count) {
+			Rng rng= createRng(seed, chunk);
+			const std::size_t begin= chunk*electronSamplerChunkSize;
+			const std::size_t end= begin + electronSamplerChunkSize < count ?
+				begin + electronSamplerChunkSize : count;
+			for (std::size_t i= begin; i < end; ++i) {
+				const double f= inverseCdf(s->rCdf, size, randomDouble(rng));
+				const double r= s->maxR*f*f;
+				const double cos_theta= -1.0 + 2.0*inverseCdf(s->cosThetaCdf, size, randomDouble(rng));
+				const double sin_theta= std::sqrt(1.0 - cos_theta*cos_theta);
+				const double phi= tau*randomDouble(rng);
+				const double sin_phi= std::sin(phi), cos_phi= std::cos(phi);
+				xyz[3*i + 0]= (float)(r*sin_theta*cos_phi);
+				xyz[3*i + 1]= (float)(r*sin_theta*sin_phi);
+				xyz[3*i + 2]= (float)(r*cos_theta);
+			}
+		}
+	};
+
+	std::thread threads[maxSamplerThreadCount];
+	for (int i= 1; i < thread_count; ++i)
+		threads[i]= std::thread(work, i);
+	work(0);
+	for (int i= 1; i < thread_count; ++i)
+		threads[i].join();
+}
+
+/// Writes `count` electron positions of |nlm> to `path` as raw little-endian float32 xyz triplets
+/// @return false on failure
+bool exportElectronPositions(const char* path, int n, int l, int m, std::size_t count)
+{
+	if (n < 1 || n >= (int)maxHPolyTermCount || l < 0 || l >= n || std::abs(m) > l) {
+		std::printf("Invalid quantum numbers: %i %i %i\n", n, l, m);
+		return false;
+	}
+
+	const HWaveFunc w= createHWaveFunc(n, l, m, 0.0);
+	ElectronSampler* sampler= (ElectronSampler*)std::malloc(sizeof(*sampler));
+	float* xyz= (float*)std::malloc(sizeof(*xyz)*3*count);
+	if (!sampler || !xyz) {
+		std::printf("Out of memory for the electron positions\n");
+		std::free(xyz);
+		std::free(sampler);
+		return false;
+	}
+	initElectronSampler(sampler, &w);
+
+	int thread_count= (int)std::thread::hardware_concurrency();
+	if (thread_count < 1)
+		thread_count= 1;
+	if (thread_count > maxSamplerThreadCount)
+		thread_count= maxSamplerThreadCount;
+	sampleElectronPositions(xyz, count, sampler, 1234, thread_count);
+
+	bool success= false;
+	if (FILE* file= std::fopen(path, "wb")) {
+		success= std::fwrite(xyz, sizeof(*xyz)*3, count, file) == count;
+		success= std::fclose(file) == 0 && success;
+	}
+	if (!success)
+		std::printf("Writing %s failed\n", path);
+
+	std::free(xyz);
+	std::free(sampler);
+	return success;
+}
+
+inline
+void testElectronSampler()
+{
+	const std::size_t count= 100000;
+	float* xyz= (float*)std::malloc(sizeof(*xyz)*3*count);
+	float* xyz_threaded= (float*)std::malloc(sizeof(*xyz)*3*count);
+	ElectronSampler* sampler= (ElectronSampler*)std::malloc(sizeof(*sampler));
+
+	{ // 1s, <r> = 1.5a_0
+		const HWaveFunc w= createHWaveFunc(1, 0, 0, 0.0);
+		initElectronSampler(sampler, &w);
+		sampleElectronPositions(xyz, count, sampler, 5, 1);
+		sampleElectronPositions(xyz_threaded, count, sampler, 5, 3);
+		assert(std::memcmp(xyz, xyz_threaded, sizeof(*xyz)*3*count) == 0);
+
+		double r_sum= 0.0;
+		for (std::size_t i= 0; i < count; ++i) {
+			const float* p= xyz + 3*i;
+			r_sum += std::sqrt(p[0]*p[0] + p[1]*p[1] + p[2]*p[2]);
+		}
+		assert(std::abs(r_sum/count - 1.5*bohrRadius) < 0.02);
+	}
+
+	{ // 2p0, <cos(theta)^2> = 3/5, <r> = 5a_0
+		const HWaveFunc w= createHWaveFunc(2, 1, 0, 0.0);
+		initElectronSampler(sampler, &w);
+		sampleElectronPositions(xyz, count, sampler, 7, 2);
+
+		double r_sum= 0.0, cos2_sum= 0.0;
+		for (std::size_t i= 0; i < count; ++i) {
+			const float* p= xyz + 3*i;
+			const double r= std::sqrt(p[0]*p[0] + p[1]*p[1] + p[2]*p[2]);
+			r_sum += r;
+			cos2_sum += p[2]*p[2]/(r*r);
+		}
+		assert(std::abs(r_sum/count - 5.0*bohrRadius) < 0.05);
+		assert(std::abs(cos2_sum/count - 0.6) < 0.01);
+	}
+
+	{ // 12s, the table resolves the innermost shell
+		const HWaveFunc w= createHWaveFunc(12, 0, 0, 0.0);
+		initElectronSampler(sampler, &w);
+		const double node= orbitalExtent(&w).radialNodes.data[0];
+		const int steps= 10000;
+		double inner= 0.0; // Integral r^2*R^2 dr over [0, node]
+		for (int i= 0; i <= steps; ++i) {
+			const double r= node*i/steps;
+			const double rho= 2.0*r/(w.n*bohrRadius);
+			double lag= rho;
+			laguerreBatch(&lag, &lag, 1, w.n - w.l - 1, 2*w.l + 1);
+			const double radial= w.normalization*std::exp(-0.5*rho)*lag;
+			inner += (i == 0 || i == steps ? 0.5 : 1.0)*r*r*radial*radial*node/steps;
+		}
+		const double f= inverseCdf(sampler->rCdf, electronSamplerTableSize, inner);
+		assert(std::abs(sampler->maxR*f*f - node) < 2e-3*node); // 4e-3 with even spacing
+	}
+
+	std::free(sampler);
+	std::free(xyz_threaded);
+	std::free(xyz);
+}
+
 struct DZLookup {
 	uint16 r, theta;
 };
 
-/// Used in `inteferenceIntegral`
-void precalc(
-		const HWaveFunc* w,
-		double* r_dependent, int r_size, double r_max,
-		double* theta_dependent, int theta_size,
-		Complex* phi_dependent, int phi_size,
-		DZLookup* dz_lookup, double z_distance)
+/// Integrals are evaluated within the sphere containing this fraction of the probability
+const double integralProbabilityFraction= 0.999;
+/// Rays are clipped to spheres containing this fraction of the probability,
+/// which leaves out nothing visible even at the maximum brightness
+const double boundingProbabilityFraction= 1.0 - 1e-7;
+
+/// Radial part C*E*L of psi_nlm at `count` radii r= r_max*i/divisions
+/// @tparam Math StdMath or FastMath
+template <typename Math>
+void radialAmplitudes(const HWaveFunc* w, double* result, int count, double r_max, int divisions)
 {
-	const double dr= r_max/r_size;
-	const double dtheta= pi/theta_size;
-	const double dphi= tau/phi_size;
+	// L, evaluated in place of rho values
+	for (int r_i= 0; r_i < count; ++r_i)
+		result[r_i]= 2*(r_max*r_i/divisions)/(w->n*bohrRadius);
+	laguerreBatch(result, result, count, w->n - w->l - 1, 2*w->l + 1);
 
-	for (int r_i= 0; r_i < r_size; ++r_i) {
-		const double r= r_max*r_i/r_size;
+	for (int r_i= 0; r_i < count; ++r_i) {
+		const double r= r_max*r_i/divisions;
 		const double rho= 2*r/(w->n*bohrRadius);
 		double amplitude= 0.0;
 		// C
 		amplitude= w->normalization;
 		// E
-		amplitude *= std::exp(-rho/2.0)*std::pow(rho, w->l);
+		amplitude *= Math::exp(-rho/2.0)*Math::pow(rho, w->l);
 		// L
-		double sum= 0.0;
-		for (std::size_t i= 0; i < maxHPolyTermCount; ++i)
-			sum += w->laguerreCoeff[i]*std::pow(rho, i);
-		amplitude *= sum;
+		amplitude *= result[r_i];
 
-		r_dependent[r_i]= amplitude;
+		result[r_i]= amplitude;
 	}
+}
 
-	// Y (without phase)
-	for (int theta_i= 0; theta_i < theta_size; ++theta_i) {
-		const double theta= pi*theta_i/theta_size;
-		const double cos_theta= std::cos(theta);
-		double sum= 0.0;
-		for (std::size_t i= 0; i < maxHPolyTermCount; ++i)
-			sum += w->spheCoeff[i]*std::pow(cos_theta, i);
-		theta_dependent[theta_i]= std::pow(std::sin(theta), std::abs(w->m))*sum;
+/// Y of psi_nlm without the phase e^(i*m*phi) at `count` angles theta= pi*i/divisions
+/// @tparam Math StdMath or FastMath
+template <typename Math>
+void angularAmplitudes(const HWaveFunc* w, double* result, int count, int divisions)
+{
+	// Evaluated in place of cos(theta) values
+	for (int theta_i= 0; theta_i < count; ++theta_i) {
+		double sin_theta;
+		Math::sinCos(pi*theta_i/divisions, &sin_theta, &result[theta_i]);
 	}
+	associatedLegendreBatch(result, result, count, w->l, std::abs(w->m));
+	const double sphe_factor= sphericalHarmonicsLegendreFactor(w->l, w->m);
+	for (int theta_i= 0; theta_i < count; ++theta_i)
+		result[theta_i] *= sphe_factor;
+}
+
+/// Used in `inteferenceIntegral`
+/// @tparam Math StdMath or FastMath
+template <typename Math, std::size_t PhiSize>
+void precalc(
+		const HWaveFunc* w,
+		double* r_dependent, int r_size, double r_max,
+		double* theta_dependent, int theta_size,
+		ComplexBatch<PhiSize>& phi_dependent,
+		DZLookup* dz_lookup, double z_distance)
+{
+	const int phi_size= (int)PhiSize;
+	const double dr= r_max/r_size;
+	const double dtheta= pi/theta_size;
+	const double dphi= tau/phi_size;
+
+	radialAmplitudes<Math>(w, r_dependent, r_size, r_max, r_size);
+	angularAmplitudes<Math>(w, theta_dependent, theta_size, theta_size);
 
 	// Y (phase)
+	phi_dependent.size= phi_size;
 	for (int phi_i= 0; phi_i < phi_size; ++phi_i) {
 		const double phi= tau*phi_i/phi_size;
-		phi_dependent[phi_i].a= std::cos(w->m*phi + w->phase);
-		phi_dependent[phi_i].b= std::sin(w->m*phi + w->phase);
+		Math::sinCos(w->m*phi + w->phase, &phi_dependent.b[phi_i], &phi_dependent.a[phi_i]);
 	}
 
 	// Lookup table for r -> r' and theta -> theta' corresponding to
 	// z -> z + dz for second wavefunction
 	const double dz= z_distance;
 	for (int theta_i= 0; theta_i < theta_size; ++theta_i) {
-		double cos_theta= std::cos(dtheta*theta_i);
+		double sin_theta, cos_theta;
+		Math::sinCos(dtheta*theta_i, &sin_theta, &cos_theta);
 		for (int r_i= 0; r_i < r_size; ++r_i) {
 			double r= r_i*dr;
 			double r_prime= std::sqrt(r*r + dz*dz - 2.0*r*dz*cos_theta);
-			double theta_prime= std::acos(clamp(
+			double theta_prime= Math::acos(clamp(
 						(r*cos_theta - dz)/(r_prime + 0.00000001),
 						0.0, 1.0));
 			assert(r_prime >= 0.0);
@@ -229,6 +1046,27 @@ void precalc(
 	}
 }
 
+/// Integral r^2*sin(theta) dr dtheta of amplitude_1(r, theta)*amplitude_2(r', theta'),
+/// where r', theta' are given by the dz lookup
+inline
+double amplitudeIntegral(
+		const double* r_1, const double* r_2, int r_steps, double dr,
+		const double* theta_1, const double* theta_2, int theta_steps, double dtheta,
+		const DZLookup* dz_lookup)
+{
+	double result= 0;
+	for (int theta_i= 0; theta_i < theta_steps; ++theta_i) {
+		const DZLookup* lookup= dz_lookup + theta_i*r_steps;
+		double r_sum= 0;
+		for (int r_i= 0; r_i < r_steps; ++r_i) {
+			const double r= dr*r_i;
+			r_sum += r*r*dr*r_1[r_i]*r_2[lookup[r_i].r]*theta_2[lookup[r_i].theta];
+		}
+		result += r_sum*theta_1[theta_i]*std::sin(dtheta*theta_i)*dtheta;
+	}
+	return result;
+}
+
 /// Integral dx^3 psi_1 * conj(psi_2)
 Complex interferenceIntegral(
 		const HWaveFunc* psi_1,
@@ -245,381 +1083,1418 @@ Complex interferenceIntegral(
 	double r_2[r_steps];
 	double theta_1[theta_steps]; // Part of spherical harmonic (theta-dependent)
 	double theta_2[theta_steps];
-	Complex phi_1[phi_steps]; // Rest of spherical harmonic (phi-dependent)
-	Complex phi_2[phi_steps];
+	ComplexBatch<phi_steps> phi_1; // Rest of spherical harmonic (phi-dependent)
+	ComplexBatch<phi_steps> phi_2;
+	DZLookup dz_lookup[r_steps*theta_steps];
+	precalc<StdMath>(psi_1, r_1, r_steps, r_max, theta_1, theta_steps, phi_1, dz_lookup, z_distance);
+	precalc<StdMath>(psi_2, r_2, r_steps, r_max, theta_2, theta_steps, phi_2, dz_lookup, z_distance);
+
+	const double dr= r_max/r_steps;
+	const double dtheta= pi/theta_steps;
+	const double dphi= tau/phi_steps;
+
+	// Volume integral
+	// The dz lookup doesn't change phi, so the integrand separates to
+	// (phi_1*conj(phi_2) summed over phi)*(real amplitudes summed over r and theta)
+	conj(phi_2);
+	mul(phi_2, phi_1, phi_2);
+	const Complex phi_integral= accumulate(phi_2);
+
+	const double r_theta_integral= amplitudeIntegral(
+			r_1, r_2, r_steps, dr, theta_1, theta_2, theta_steps, dtheta, dz_lookup);
+	Complex result= { phi_integral.a*r_theta_integral*dphi, phi_integral.b*r_theta_integral*dphi };
+	return result;
+}
+
+/// Integral part of the normalization factor for the hydrogen molecule
+/// int dx_1^3 Real(conj(psi_1) * psi_2 * interferenceIntegral) 
+/// @todo Merge with `interferenceIntegral` as it's almost the same calculation
+double H2_N_integralPart(
+		const HWaveFunc* psi_1,
+		const HWaveFunc* psi_2,
+		const Complex interference_integral,
+		double r_max,
+		double z_distance)
+{
+	const int r_steps= 150;
+	const int theta_steps= 100;
+	const int phi_steps= 100;
+
+	// Wavefunction values are divided to different precalculated tables
+	double r_1[r_steps]; // Normalization and r-dependencies
+	double r_2[r_steps];
+	double theta_1[theta_steps]; // Part of spherical harmonic (theta-dependent)
+	double theta_2[theta_steps];
+	ComplexBatch<phi_steps> phi_1; // Rest of spherical harmonic (phi-dependent)
+	ComplexBatch<phi_steps> phi_2;
 	DZLookup dz_lookup[r_steps*theta_steps];
-	precalc(psi_1, r_1, r_steps, r_max, theta_1, theta_steps, phi_1, phi_steps, dz_lookup, z_distance);
-	precalc(psi_2, r_2, r_steps, r_max, theta_2, theta_steps, phi_2, phi_steps, dz_lookup, z_distance);
+	precalc<StdMath>(psi_1, r_1, r_steps, r_max, theta_1, theta_steps, phi_1, dz_lookup, z_distance);
+	precalc<StdMath>(psi_2, r_2, r_steps, r_max, theta_2, theta_steps, phi_2, dz_lookup, z_distance);
 
 	const double dr= r_max/r_steps;
 	const double dtheta= pi/theta_steps;
 	const double dphi= tau/phi_steps;
 
-	// Volume integral
-	Complex result= {};
-	for (int theta_i= 0; theta_i < theta_steps; ++theta_i) {
-		const double sin_theta= std::sin(dtheta*theta_i);
-		for (int phi_i= 0; phi_i < phi_steps; ++phi_i) {
-			for (int r_i= 0; r_i < r_steps; ++r_i) {
-				double amplitude_1= r_1[r_i]*theta_1[theta_i];
-
-				DZLookup lookup= dz_lookup[r_i + theta_i*r_steps];
-				double amplitude_2= r_2[lookup.r]*theta_2[lookup.theta];
-
-				Complex v1= { amplitude_1*phi_1[phi_i].a, amplitude_1*phi_1[phi_i].b };
-				Complex v2= { amplitude_2*phi_2[phi_i].a, amplitude_2*phi_2[phi_i].b };
-				Complex value= v1*conj(v2);
-
-				double r= dr*r_i;
-				double dV= r*r*sin_theta*dr*dphi*dtheta;
-				result.a += value.a*dV;
-				result.b += value.b*dV;
+	// Volume integral, separated as in `interferenceIntegral`
+	conj(phi_1);
+	mul(phi_1, phi_1, phi_2);
+	const Complex phi_integral= accumulate(phi_1)*interference_integral;
+
+	const double r_theta_integral= amplitudeIntegral(
+			r_1, r_2, r_steps, dr, theta_1, theta_2, theta_steps, dtheta, dz_lookup);
+	return phi_integral.a*r_theta_integral*dphi;
+}
+
+/// Adds hydrogen wave function `w` at position `pos` (name of a GLSL vec3) to `e`
+/// as nodes of the real and imaginary parts
+/// Angular part is a polynomial of the Cartesian coordinates, so that there's no trigonometry:
+///   r^l*sin(theta)^|m|*P(cos(theta))*e^(i*m*phi) = (x +- iy)^|m|*sum_k(p_k*z^k*r^(l - |m| - k)),
+/// where P has only powers of the same parity as l - |m|, so r appears only as r^2.
+void hydrogenWaveFuncExpr(Expr& e, const HWaveFunc* w, const char* pos, int* real, int* imag)
+{
+	assert(w && real && imag);
+
+	char var_name[sizeof(ExprNode().name)];
+	std::snprintf(var_name, sizeof(var_name), "dot(%s, %s)", pos, pos);
+	const int r2= exprVar(e, var_name);
+	const int r= exprFunc(e, ExprOp_sqrt, r2);
+	std::snprintf(var_name, sizeof(var_name), "%s.x", pos);
+	const int x= exprVar(e, var_name);
+	std::snprintf(var_name, sizeof(var_name), "%s.y", pos);
+	const int y= exprVar(e, var_name);
+	std::snprintf(var_name, sizeof(var_name), "%s.z", pos);
+	const int z= exprVar(e, var_name);
+
+	// C*E*L/r^l, with C and rho = rho_mul*r folded into the coefficients of the polynomial in r
+	const double rho_mul= 2.0/bohrRadius/w->n;
+	double radial_coeff[maxHPolyTermCount];
+	for (std::size_t i= 0; i < maxHPolyTermCount; ++i)
+		radial_coeff[i]= w->normalization*std::pow(rho_mul, w->l + i)*w->laguerreCoeff[i];
+	const int radial= exprMul(e,
+			exprFunc(e, ExprOp_exp, exprMul(e, exprConst(e, -0.5*rho_mul), r)),
+			exprPolynomial(e, r, radial_coeff, maxHPolyTermCount));
+
+	// r^l*Y
+	const int abs_m= std::abs(w->m);
+	const int angular_degree= w->l - abs_m;
+	const int angular= exprHomogeneousPolynomial(e, z, r2, w->spheCoeff, angular_degree);
+	int phase_re, phase_im;
+	exprComplexIntPow(e, x, exprMul(e, exprConst(e, w->m < 0 ? -1.0 : 1.0), y), abs_m,
+			&phase_re, &phase_im);
+
+	// Constant phase e^(i*phase)
+	const int phase_cos= exprFunc(e, ExprOp_cos, exprConst(e, w->phase));
+	const int phase_sin= exprFunc(e, ExprOp_sin, exprConst(e, w->phase));
+	exprComplexMul(e, phase_re, phase_im, phase_cos, phase_sin, &phase_re, &phase_im);
+
+	const int amplitude= exprMul(e, radial, angular); // Can be negative
+	*real= exprMul(e, amplitude, phase_re);
+	*imag= exprMul(e, amplitude, phase_im);
+}
+
+/// True if the bounds and the molecule integrals of `a` and `b` are the same,
+/// i.e. they have the same waves at the same translations
+bool sameWaves(const VolumeParams& a, const VolumeParams& b)
+{
+	if (a.waveCount != b.waveCount || a.h2Symmetry != b.h2Symmetry)
+		return false;
+	for (std::size_t i= 0; i < a.waveCount; ++i) {
+		const HWaveFunc& wa= a.waves[i];
+		const HWaveFunc& wb= b.waves[i];
+		if (	wa.n != wb.n || wa.l != wb.l || wa.m != wb.m || wa.phase != wb.phase ||
+				a.translations[i] != b.translations[i])
+			return false;
+	}
+	return true;
+}
+
+/// @param reuse Bounds and integrals are copied from `reuse` when it has the same waves, see `sameWaves`,
+///              so that changing only the appearance doesn't evaluate the orbital extents and integrals
+VolumeParams createVolumeParams(
+		const int sample_count,
+		const bool complex_color,
+		const float absorption,
+		const float cutoff,
+		const float visual_brightness,
+		const bool h2_symmetry,
+		const Program::Wave* waves,
+		const std::size_t wave_count,
+		const bool integrals= true,
+		const VolumeParams* reuse= NULL)
+{
+	assert(wave_count <= Program_maxWaves);
+	VolumeParams params= {};
+	params.sampleCount= sample_count;
+	params.complexColor= complex_color;
+	params.absorption= absorption;
+	params.cutoff= cutoff;
+	params.visualAmplitude= std::pow(visual_brightness, 5);
+	params.h2Symmetry= h2_symmetry;
+	params.waveCount= wave_count;
+	for (std::size_t wave_i= 0; wave_i < wave_count; ++wave_i) {
+		params.waves[wave_i]= createHWaveFunc(
+				waves[wave_i].n,
+				waves[wave_i].l,
+				waves[wave_i].m,
+				waves[wave_i].phase);
+		params.translations[wave_i]= waves[wave_i].translation;
+		if (wave_count > 1 && waves[wave_i].translation != 0.0)
+			params.molecule= true;
+	}
+	if (reuse && wave_count > 0 && sameWaves(*reuse, params)) {
+		std::memcpy(params.bounds, reuse->bounds, sizeof(params.bounds));
+		std::memcpy(params.gridMin, reuse->gridMin, sizeof(params.gridMin));
+		std::memcpy(params.gridSize, reuse->gridSize, sizeof(params.gridSize));
+		params.interference= reuse->interference;
+		params.moleculeN= reuse->moleculeN;
+		return params;
+	}
+	for (std::size_t wave_i= 0; wave_i < wave_count; ++wave_i) {
+		// Wave is evaluated at p + translation in molecule mode
+		float* bound= params.bounds[wave_i];
+		bound[0]= bound[1]= 0.0;
+		bound[2]= params.molecule ? -params.translations[wave_i] : 0.0;
+		bound[3]= enclosingRadius(orbitalExtent(&params.waves[wave_i]), boundingProbabilityFraction);
+	}
+	for (int axis= 0; axis < 3; ++axis) {
+		float min= -1.0, max= 1.0; // Arbitrary when there are no waves
+		for (std::size_t wave_i= 0; wave_i < wave_count; ++wave_i) {
+			const float* bound= params.bounds[wave_i];
+			if (wave_i == 0 || bound[axis] - bound[3] < min)
+				min= bound[axis] - bound[3];
+			if (wave_i == 0 || bound[axis] + bound[3] > max)
+				max= bound[axis] + bound[3];
+		}
+		params.gridMin[axis]= min;
+		params.gridSize[axis]= max - min;
+	}
+
+#ifdef DEBUG
+	if (integrals && wave_count > 0) {
+		const HWaveFunc* wf= &params.waves[0];
+		double max_r= enclosingRadius(orbitalExtent(wf), integralProbabilityFraction);
+		Complex I= interferenceIntegral(wf, wf, max_r, 0.0);
+		std::printf("<psi|psi>: %f, %f\n", I.a, I.b);
+	}
+#endif
+
+	if (params.molecule && integrals) {
+		assert(wave_count == 2 && "Molecule visualization only supported for exactly two wavefuncs");
+		const HWaveFunc* hwavefuncs= params.waves;
+		const double z_distance= waves[1].translation - waves[0].translation;
+		const double radius_0= enclosingRadius(orbitalExtent(&hwavefuncs[0]), integralProbabilityFraction);
+		const double radius_1= enclosingRadius(orbitalExtent(&hwavefuncs[1]), integralProbabilityFraction);
+		const double max_r= std::abs(z_distance) + (radius_0 > radius_1 ? radius_0 : radius_1);
+		params.interference= interferenceIntegral(
+				&hwavefuncs[0], &hwavefuncs[1], max_r,
+				z_distance);
+		std::printf("<psi_1|psi_2>: %f, %f\n", params.interference.a, params.interference.b);
+
+		const double n_int_part= H2_N_integralPart(
+				&hwavefuncs[0], &hwavefuncs[1], params.interference, max_r,
+				z_distance);
+		double N= 1.0/(2.0 + (h2_symmetry ? 1 : -1)*2.0*n_int_part);
+		if (N < 0.0)
+			N= 0; // Happens when antisymmetric electrons are really close
+		std::printf("N: %f\n", N);
+		params.moleculeN= N;
+	}
+	return params;
+}
+
+/// Probability density of the visualized state at `count` points, as computed by the volume shader
+/// @param total Sum of the waves at the points, for the complex color. Optional
+void volumeDensityBatch(
+		double* P, const VolumeParams& params,
+		const double* x, const double* y, const double* z, int count,
+		Complex* total= NULL)
+{
+	const int chunk_size= 64;
+	for (int begin= 0; begin < count; begin += chunk_size) {
+		const int size= count - begin < chunk_size ? count - begin : chunk_size;
+		Complex psi[Program_maxWaves][chunk_size]= {};
+		for (std::size_t w= 0; w < params.waveCount; ++w) {
+			// Wave is evaluated at p + translation in molecule mode
+			double wave_z[chunk_size];
+			for (int i= 0; i < size; ++i)
+				wave_z[i]= z[begin + i] + (params.molecule ? params.translations[w] : 0.0);
+			evalHWaveFunc(psi[w], &params.waves[w], x + begin, y + begin, wave_z, size);
+		}
+
+		for (int i= 0; i < size; ++i) {
+			Complex sum= { 0.0, 0.0 };
+			for (std::size_t w= 0; w < params.waveCount; ++w) {
+				sum.a += psi[w][i].a;
+				sum.b += psi[w][i].b;
+			}
+			if (total)
+				total[begin + i]= sum;
+
+			if (params.molecule) {
+				const Complex p0= psi[0][i], p1= psi[1][i];
+				const Complex I= params.interference;
+				const double real_interf=
+					(p0.a*p1.a + p0.b*p1.b)*I.a + (p1.a*p0.b - p0.a*p1.b)*I.b;
+				P[begin + i]= params.moleculeN*(
+						p0.a*p0.a + p0.b*p0.b + p1.a*p1.a + p1.b*p1.b +
+						(params.h2Symmetry ? 2.0 : -2.0)*real_interf);
+			} else {
+				P[begin + i]= sum.a*sum.a + sum.b*sum.b;
 			}
 		}
 	}
-	return result;
 }
 
-/// Integral part of the normalization factor for the hydrogen molecule
-/// int dx_1^3 Real(conj(psi_1) * psi_2 * interferenceIntegral) 
-/// @todo Merge with `interferenceIntegral` as it's almost the same calculation
-double H2_N_integralPart(
-		const HWaveFunc* psi_1,
-		const HWaveFunc* psi_2,
-		const Complex interference_integral,
-		double r_max,
-		double z_distance)
-{
-	const int r_steps= 150;
-	const int theta_steps= 100;
-	const int phi_steps= 100;
+/// Cells per side of the occupancy grid
+const int occupancyGridReso= 32;
+const int maxOccupancyThreadCount= 16;
 
-	// Wavefunction values are divided to different precalculated tables
-	double r_1[r_steps]; // Normalization and r-dependencies
-	double r_2[r_steps];
-	double theta_1[theta_steps]; // Part of spherical harmonic (theta-dependent)
-	double theta_2[theta_steps];
-	Complex phi_1[phi_steps]; // Rest of spherical harmonic (phi-dependent)
-	Complex phi_2[phi_steps];
-	DZLookup dz_lookup[r_steps*theta_steps];
-	precalc(psi_1, r_1, r_steps, r_max, theta_1, theta_steps, phi_1, phi_steps, dz_lookup, z_distance);
-	precalc(psi_2, r_2, r_steps, r_max, theta_2, theta_steps, phi_2, phi_steps, dz_lookup, z_distance);
+/// Width of the radial shell of |nlm> containing radius `r`, bounded by nodes or the bulk of the outer lobe
+double radialShellWidth(const OrbitalExtent& e, double r)
+{
+	double inner= 0.0;
+	for (std::size_t i= 0; i < e.radialNodes.size; ++i) {
+		if (r < e.radialNodes.data[i])
+			return e.radialNodes.data[i] - inner;
+		inner= e.radialNodes.data[i];
+	}
+	return enclosingRadius(e, 0.9) - inner;
+}
 
-	const double dr= r_max/r_steps;
-	const double dtheta= pi/theta_steps;
-	const double dphi= tau/phi_steps;
+/// Finds the cells of the grid spanned by `params.gridMin` and `params.gridSize` which might
+/// contribute to the image, so that the volume shader can skip the rest of the cells
+/// Density is sampled at the corners, edge and face midpoints and the center of every cell,
+/// and occupied cells are dilated by one cell to cover features between the samples
+/// @param weights occupancyGridReso^3 cells, x varying fastest. Relative sample density
+///                of the cell from 1 to 255, 0 if the cell is empty
+/// @param adaptive Otherwise all occupied cells have the weight 255. Weight is inversely proportional
+///                 to the width of the radial shell, so that the thin inner shells of high n
+///                 get as many samples as the wide outer lobe
+void computeOccupancyGrid(unsigned char* weights, const VolumeParams& params, bool adaptive)
+{
+	const int reso= occupancyGridReso;
+	const int lattice= 2*reso + 1; // Samples per side
+	double cell_size[3];
+	for (int axis= 0; axis < 3; ++axis)
+		cell_size[axis]= params.gridSize[axis]/reso;
+	const double cell_diagonal= std::sqrt(	cell_size[0]*cell_size[0] +
+											cell_size[1]*cell_size[1] +
+											cell_size[2]*cell_size[2]);
+
+	// Density below the cutoff is invisible. Otherwise, emission at most P*2 per unit length
+	// (see color sliders) over the grid diagonal stays below half of an 8-bit step
+	const double visible_P= std::max((double)params.cutoff, 0.25/255.0/(cell_diagonal*reso));
+
+	// Rays are clipped to the bounds, so only samples near them matter
+	float* lattice_P= (float*)std::malloc(sizeof(*lattice_P)*lattice*lattice*lattice);
+	auto work= [=](int thread_i, int thread_count) {
+		double x[lattice], y[lattice], z[lattice], P[lattice];
+		int index[lattice];
+		for (int pz= thread_i; pz < lattice; pz += thread_count) {
+			for (int py= 0; py < lattice; ++py) {
+				int count= 0;
+				for (int px= 0; px < lattice; ++px) {
+					const double p[3]= {
+						params.gridMin[0] + 0.5*cell_size[0]*px,
+						params.gridMin[1] + 0.5*cell_size[1]*py,
+						params.gridMin[2] + 0.5*cell_size[2]*pz
+					};
+					lattice_P[(pz*lattice + py)*lattice + px]= 0.0;
+					for (std::size_t w= 0; w < params.waveCount; ++w) {
+						const float* bound= params.bounds[w];
+						const double dx= p[0] - bound[0], dy= p[1] - bound[1], dz= p[2] - bound[2];
+						const double radius= bound[3] + cell_diagonal;
+						if (dx*dx + dy*dy + dz*dz < radius*radius) {
+							x[count]= p[0];
+							y[count]= p[1];
+							z[count]= p[2];
+							index[count++]= px;
+							break;
+						}
+					}
+				}
+				volumeDensityBatch(P, params, x, y, z, count);
+				for (int i= 0; i < count; ++i)
+					lattice_P[(pz*lattice + py)*lattice + index[i]]= P[i]*params.visualAmplitude;
+			}
+		}
+	};
 
-	// Volume integral
-	double result= 0;
-	for (int theta_i= 0; theta_i < theta_steps; ++theta_i) {
-		const double sin_theta= std::sin(dtheta*theta_i);
-		for (int phi_i= 0; phi_i < phi_steps; ++phi_i) {
-			for (int r_i= 0; r_i < r_steps; ++r_i) {
-				double amplitude_1= r_1[r_i]*theta_1[theta_i];
+	int thread_count= (int)std::thread::hardware_concurrency();
+	if (thread_count < 1)
+		thread_count= 1;
+	if (thread_count > maxOccupancyThreadCount)
+		thread_count= maxOccupancyThreadCount;
+	std::thread threads[maxOccupancyThreadCount];
+	for (int i= 1; i < thread_count; ++i)
+		threads[i]= std::thread(work, i, thread_count);
+	work(0, thread_count);
+	for (int i= 1; i < thread_count; ++i)
+		threads[i].join();
+
+	// Samples 2c, 2c + 1 and 2c + 2 are in cell c
+	float* cell_max= (float*)std::malloc(sizeof(*cell_max)*reso*reso*reso);
+	for (int cz= 0; cz < reso; ++cz)
+	for (int cy= 0; cy < reso; ++cy)
+	for (int cx= 0; cx < reso; ++cx) {
+		float m= 0.0;
+		for (int pz= 2*cz; pz <= 2*cz + 2; ++pz)
+		for (int py= 2*cy; py <= 2*cy + 2; ++py)
+		for (int px= 2*cx; px <= 2*cx + 2; ++px)
+			m= std::max(m, lattice_P[(pz*lattice + py)*lattice + px]);
+		cell_max[(cz*reso + cy)*reso + cx]= m;
+	}
 
-				DZLookup lookup= dz_lookup[r_i + theta_i*r_steps];
-				double amplitude_2= r_2[lookup.r]*theta_2[lookup.theta];
+	OrbitalExtent extents[Program_maxWaves];
+	for (std::size_t w= 0; w < params.waveCount; ++w)
+		extents[w]= orbitalExtent(&params.waves[w]);
+
+	// Cells are occupied if the dilated maximum is visible, weights in `density` before quantization
+	float* density= (float*)std::malloc(sizeof(*density)*reso*reso*reso);
+	float max_density= 0.0;
+	for (int cz= 0; cz < reso; ++cz)
+	for (int cy= 0; cy < reso; ++cy)
+	for (int cx= 0; cx < reso; ++cx) {
+		float m= 0.0;
+		for (int z= std::max(0, cz - 1); z <= std::min(reso - 1, cz + 1); ++z)
+		for (int y= std::max(0, cy - 1); y <= std::min(reso - 1, cy + 1); ++y)
+		for (int x= std::max(0, cx - 1); x <= std::min(reso - 1, cx + 1); ++x)
+			m= std::max(m, cell_max[(z*reso + y)*reso + x]);
+		float& d= density[(cz*reso + cy)*reso + cx];
+		d= m >= visible_P ? 1.0 : 0.0;
+		if (adaptive && d > 0.0) {
+			double width= 0.0;
+			for (std::size_t w= 0; w < params.waveCount; ++w) {
+				const float* bound= params.bounds[w];
+				const double dx= params.gridMin[0] + cell_size[0]*(cx + 0.5) - bound[0];
+				const double dy= params.gridMin[1] + cell_size[1]*(cy + 0.5) - bound[1];
+				const double dz= params.gridMin[2] + cell_size[2]*(cz + 0.5) - bound[2];
+				const double r= std::sqrt(dx*dx + dy*dy + dz*dz);
+				const double shell= radialShellWidth(extents[w], r);
+				if (w == 0 || shell < width)
+					width= shell;
+			}
+			d= 1.0/std::max(width, cell_diagonal);
+		}
+		max_density= std::max(max_density, d);
+	}
 
-				Complex v1= { amplitude_1*phi_1[phi_i].a, amplitude_1*phi_1[phi_i].b };
-				Complex v2= { amplitude_2*phi_2[phi_i].a, amplitude_2*phi_2[phi_i].b };
-				Complex value= conj(v1)*v2*interference_integral;
+	// Occupied cells stay distinct from empty ones
+	const float min_weight= 1.0/32.0;
+	for (int i= 0; i < reso*reso*reso; ++i) {
+		if (density[i] > 0.0) {
+			const float weight= std::max(min_weight, density[i]/max_density);
+			weights[i]= (unsigned char)(weight*255.0 + 0.5);
+		} else {
+			weights[i]= 0;
+		}
+	}
+	std::free(density);
+	std::free(cell_max);
+	std::free(lattice_P);
+}
 
-				double r= dr*r_i;
-				double dV= r*r*sin_theta*dr*dphi*dtheta;
-				result += value.a*dV;
+inline
+void testOccupancyGrid()
+{
+	const int reso= occupancyGridReso;
+	static unsigned char occupied[reso*reso*reso];
+	static unsigned char weights[reso*reso*reso];
+	Program::Wave waves[2]= {};
+	waves[0].n= 4;
+	waves[0].l= 2;
+	waves[0].m= 1;
+	waves[1].n= 2;
+	waves[1].l= 1;
+	waves[1].translation= 3.0;
+	for (std::size_t wave_count= 0; wave_count <= 2; ++wave_count) {
+		const VolumeParams params=
+			createVolumeParams(40, false, 0.0, 0.0, 3.0, true, waves, wave_count);
+		computeOccupancyGrid(occupied, params, false);
+		computeOccupancyGrid(weights, params, true);
+
+		int occupied_count= 0;
+		int max_weight= 0;
+		for (int i= 0; i < reso*reso*reso; ++i) {
+			assert(occupied[i] == 0 || occupied[i] == 255);
+			assert((occupied[i] != 0) == (weights[i] != 0));
+			assert(weights[i] == 0 || weights[i] >= 255/32);
+			occupied_count += occupied[i] != 0;
+			max_weight= std::max(max_weight, (int)weights[i]);
+		}
+		assert(wave_count > 0 || occupied_count == 0);
+		assert(occupied_count < reso*reso*reso);
+		assert(wave_count == 0 || max_weight == 255);
+
+		// Clearly visible density is never in an empty cell
+		Rng rng= createRng(7, wave_count);
+		for (int i= 0; i < 2000; ++i) {
+			double p[3];
+			int cell[3];
+			for (int axis= 0; axis < 3; ++axis) {
+				const double u= randomDouble(rng);
+				p[axis]= params.gridMin[axis] + u*params.gridSize[axis];
+				cell[axis]= std::min(reso - 1, (int)(u*reso));
 			}
+			double P;
+			volumeDensityBatch(&P, params, &p[0], &p[1], &p[2], 1);
+			if (P*params.visualAmplitude > 1e-3)
+				assert(occupied[(cell[2]*reso + cell[1])*reso + cell[0]]);
 		}
 	}
-	return result;
 }
 
-/// Formula for hydrogen wave function with parameters r, theta, and phi
-void hydrogenWaveFuncStr(const HWaveFunc* w, String* amplitude, String* phase_str)
+/// Uploads the weights of `computeOccupancyGrid` to the 3D texture `tex_id`
+void uploadOccupancyGrid(GLuint tex_id, const unsigned char* weights)
+{
+	const int reso= occupancyGridReso;
+	glBindTexture(GL_TEXTURE_3D, tex_id);
+	glTexImage3D(	GL_TEXTURE_3D, 0, GL_LUMINANCE,
+					reso, reso, reso,
+					0, GL_LUMINANCE, GL_UNSIGNED_BYTE,
+					weights);
+}
+
+/// Voxels per side of the density texture
+const int densityTextureReso= 128;
+const int maxDensityThreadCount= 16;
+
+/// Samples the visualized state at the voxel centers of the grid spanned by `params.gridMin`
+/// and `params.gridSize`, so that the volume shader can look it up instead of evaluating the waves
+/// @param texels reso^3 voxels of three channels, x varying fastest: sqrt(P/max_P), and the unit
+///               phasor of the total wave function mapped from [-1, 1] to [0, 1]. The square root
+///               keeps the faint outer lobes above the 16-bit quantization
+/// @return max_P, 0 if there are no waves
+double computeDensityTexture(unsigned short* texels, int reso, const VolumeParams& params)
 {
-	assert(w && amplitude->str && phase_str->str);
+	double voxel_size[3];
+	for (int axis= 0; axis < 3; ++axis)
+		voxel_size[axis]= params.gridSize[axis]/reso;
+	const double voxel_diagonal= std::sqrt(	voxel_size[0]*voxel_size[0] +
+											voxel_size[1]*voxel_size[1] +
+											voxel_size[2]*voxel_size[2]);
+
+	float* voxel_P= (float*)std::malloc(sizeof(*voxel_P)*reso*reso*reso);
+	double thread_max_P[maxDensityThreadCount]= {};
+	auto work= [=, &thread_max_P](int thread_i, int thread_count) {
+		double* x= (double*)std::malloc(sizeof(double)*reso*4);
+		double* y= x + reso;
+		double* z= y + reso;
+		double* P= z + reso;
+		Complex* total= (Complex*)std::malloc(sizeof(Complex)*reso);
+		int* index= (int*)std::malloc(sizeof(int)*reso);
+		for (int vz= thread_i; vz < reso; vz += thread_count) {
+			for (int vy= 0; vy < reso; ++vy) {
+				int count= 0;
+				for (int vx= 0; vx < reso; ++vx) {
+					const double p[3]= {
+						params.gridMin[0] + voxel_size[0]*(vx + 0.5),
+						params.gridMin[1] + voxel_size[1]*(vy + 0.5),
+						params.gridMin[2] + voxel_size[2]*(vz + 0.5)
+					};
+					const int i= (vz*reso + vy)*reso + vx;
+					voxel_P[i]= 0.0;
+					texels[3*i + 1]= 32768; // Phasor of zero is (0, 1), like in `unitPhasor`
+					texels[3*i + 2]= 65535;
+
+					// Rays are clipped to the bounds, so only voxels near them are looked up
+					for (std::size_t w= 0; w < params.waveCount; ++w) {
+						const float* bound= params.bounds[w];
+						const double dx= p[0] - bound[0], dy= p[1] - bound[1], dz= p[2] - bound[2];
+						const double radius= bound[3] + voxel_diagonal;
+						if (dx*dx + dy*dy + dz*dz < radius*radius) {
+							x[count]= p[0];
+							y[count]= p[1];
+							z[count]= p[2];
+							index[count++]= i;
+							break;
+						}
+					}
+				}
+				volumeDensityBatch(P, params, x, y, z, count, total);
+				for (int k= 0; k < count; ++k) {
+					const int i= index[k];
+					voxel_P[i]= (float)std::max(P[k], 0.0);
+					thread_max_P[thread_i]= std::max(thread_max_P[thread_i], (double)voxel_P[i]);
+					const double len= std::sqrt(total[k].a*total[k].a + total[k].b*total[k].b);
+					if (len > 0.0) {
+						texels[3*i + 1]= (unsigned short)((0.5 + 0.5*total[k].a/len)*65535.0 + 0.5);
+						texels[3*i + 2]= (unsigned short)((0.5 + 0.5*total[k].b/len)*65535.0 + 0.5);
+					}
+				}
+			}
+		}
+		std::free(index);
+		std::free(total);
+		std::free(x);
+	};
+
+	int thread_count= (int)std::thread::hardware_concurrency();
+	if (thread_count < 1)
+		thread_count= 1;
+	if (thread_count > maxDensityThreadCount)
+		thread_count= maxDensityThreadCount;
+	std::thread threads[maxDensityThreadCount];
+	for (int i= 1; i < thread_count; ++i)
+		threads[i]= std::thread(work, i, thread_count);
+	work(0, thread_count);
+	for (int i= 1; i < thread_count; ++i)
+		threads[i].join();
+
+	double max_P= 0.0;
+	for (int i= 0; i < thread_count; ++i)
+		max_P= std::max(max_P, thread_max_P[i]);
+	for (int i= 0; i < reso*reso*reso; ++i) {
+		const double amplitude= max_P > 0.0 ? std::sqrt(voxel_P[i]/max_P) : 0.0;
+		texels[3*i]= (unsigned short)(amplitude*65535.0 + 0.5);
+	}
+	std::free(voxel_P);
+	return max_P;
+}
 
-	const std::size_t rho_str_size= 16;
-	char rho_str[rho_str_size];
-	std::snprintf(rho_str, rho_str_size, "%e*r", 2.0/bohrRadius/w->n);
+inline
+void testDensityTexture()
+{
+	const int reso= 16;
+	static unsigned short texels[3*reso*reso*reso];
+	Program::Wave waves[2]= {};
+	waves[0].n= 3;
+	waves[0].l= 2;
+	waves[0].m= 1;
+	waves[1].n= 2;
+	waves[1].l= 1;
+	waves[1].phase= 1.0;
+	for (int molecule= 0; molecule <= 1; ++molecule) {
+		waves[1].translation= molecule ? 2.0 : 0.0; // Superposition otherwise
+		for (std::size_t wave_count= 0; wave_count <= 2; ++wave_count) {
+			const VolumeParams params=
+				createVolumeParams(40, false, 0.0, 0.0, 3.0, true, waves, wave_count);
+			const double max_P= computeDensityTexture(texels, reso, params);
+			assert(wave_count > 0 || max_P == 0.0);
+
+			int max_texel= 0;
+			for (int vz= 0; vz < reso; ++vz)
+			for (int vy= 0; vy < reso; ++vy)
+			for (int vx= 0; vx < reso; ++vx) {
+				const int i= (vz*reso + vy)*reso + vx;
+				max_texel= std::max(max_texel, (int)texels[3*i]);
+
+				// Voxel centers decode back to the sampled state
+				const double p[3]= {
+					params.gridMin[0] + params.gridSize[0]*(vx + 0.5)/reso,
+					params.gridMin[1] + params.gridSize[1]*(vy + 0.5)/reso,
+					params.gridMin[2] + params.gridSize[2]*(vz + 0.5)/reso
+				};
+				double P;
+				Complex total;
+				volumeDensityBatch(&P, params, &p[0], &p[1], &p[2], 1, &total);
+				const double amplitude= texels[3*i]/65535.0;
+				if (texels[3*i] > 0)
+					assert(std::abs(amplitude*amplitude*max_P - P) <= 2.0*amplitude*max_P/65535.0 + 1e-9);
+				const double len= std::sqrt(total.a*total.a + total.b*total.b);
+				if (texels[3*i] > 0 && len > 1e-9) {
+					assert(std::abs(2.0*texels[3*i + 1]/65535.0 - 1.0 - total.a/len) < 1e-4);
+					assert(std::abs(2.0*texels[3*i + 2]/65535.0 - 1.0 - total.b/len) < 1e-4);
+				}
+			}
+			assert(wave_count == 0 || max_texel == 65535);
+		}
+	}
+}
 
-	// C
-	append(amplitude, "%e*%e",
-		w->normalization,
-		1.0 //1.0 + 2.0*std::pow(w->n, 2.0) // Totally ad-hoc factor to keep the brightness at somewhat const level
-		);
-	append(amplitude, "*");
+/// Uploads the texels of `computeDensityTexture` with reso densityTextureReso to the 3D texture `tex_id`
+void uploadDensityTexture(GLuint tex_id, const unsigned short* texels)
+{
+	const int reso= densityTextureReso;
+	glBindTexture(GL_TEXTURE_3D, tex_id);
+	glTexImage3D(	GL_TEXTURE_3D, 0, GL_RGB16,
+					reso, reso, reso,
+					0, GL_RGB, GL_UNSIGNED_SHORT,
+					texels);
+}
 
-	// E
-	append(amplitude, "exp(-%s/2.0)*pow(%s, %i.0)", rho_str, rho_str, w->l);
-	append(amplitude, "*");
+/// Texels per wave in the wave lookup texture
+const int waveLookupSize= 2048;
+
+/// Tabulates the separable parts of the waves of `params` over the bounds, so that the volume shader
+/// can look them up instead of evaluating polynomials and exponentials
+/// @param texels waveLookupSize texels of two channels per wave. First channel is the radial part
+///               at r= bound_radius*i/(waveLookupSize - 1), second the angular part without
+///               sin(theta)^|m| and the phase at cos(theta)= 2*i/(waveLookupSize - 1) - 1, as the
+///               shader gets those from the complex power ((x +- iy)/r)^|m|. Value v relative to the maximum of the channel
+///               is stored as 0.5 + 0.5*sign(v)*sqrt(|v|), so that the faint tails survive 16 bits
+/// @param scale Product of the channel maxima per wave, which multiplies the looked up amplitude
+void computeWaveLookup(unsigned short* texels, float* scale, const VolumeParams& params)
+{
+	const int size= waveLookupSize;
+	for (std::size_t w= 0; w < Program_maxWaves; ++w) {
+		unsigned short* row= texels + 2*size*w;
+		scale[w]= 0.0;
+		if (w >= params.waveCount) {
+			for (int i= 0; i < 2*size; ++i)
+				row[i]= 32768;
+			continue;
+		}
 
-	{ // L
-		append(amplitude, "(");
-		for (std::size_t i= 0; i < maxHPolyTermCount; ++i) {
-			if (w->laguerreCoeff[i] == 0.0)
-				continue;
+		// Radial part in float32 is plenty for 16-bit texels
+		const HWaveFunc& wave= params.waves[w];
+		const double rho_mul= 2.0/(wave.n*bohrRadius);
+		float radial_f[waveLookupSize];
+		for (int i= 0; i < size; ++i)
+			radial_f[i]= (float)(rho_mul*params.bounds[w][3]*i/(size - 1));
+		hydrogenRadialBatch(radial_f, radial_f, size, wave.n, wave.l, wave.normalization);
+
+		double radial[waveLookupSize], angular[waveLookupSize];
+		for (int i= 0; i < size; ++i) {
+			radial[i]= radial_f[i];
+			const double cos_theta= 2.0*i/(size - 1) - 1.0;
+			angular[i]= 0.0;
+			for (int k= (int)maxHPolyTermCount - 1; k >= 0; --k)
+				angular[i]= angular[i]*cos_theta + wave.spheCoeff[k];
+		}
 
-			append(amplitude, "+%e", w->laguerreCoeff[i]);
-			if (i != 0)
-				append(amplitude, "*pow(%s, %i.0)", rho_str, i);
+		double max_radial= 0.0, max_angular= 0.0;
+		for (int i= 0; i < size; ++i) {
+			max_radial= std::max(max_radial, std::abs(radial[i]));
+			max_angular= std::max(max_angular, std::abs(angular[i]));
 		}
-		append(amplitude, ")");
-	}
-	append(amplitude, "*");
-
-	{ // Y
-		if (w->m != 0)
-			append(amplitude,
-				"%s*pow(abs(sin_theta), %i.0)*",
-				(std::abs(w->m) % 2 ? "sign(sin_theta)" : "1.0"),
-				std::abs(w->m));
-		append(amplitude, "(");
-
-		for (std::size_t i= 0; i < maxHPolyTermCount; ++i) {
-			if (w->spheCoeff[i] == 0.0)
-				continue;
-
-			append(amplitude, "+(%e)", w->spheCoeff[i]);
-			if (i != 0)
-				append(amplitude,
-					"*%s*pow(abs(cos_theta), %i.0)",
-					(i % 2 ? "sign(cos_theta)" : "1.0"),
-					i);
+		scale[w]= max_radial*max_angular;
+		for (int i= 0; i < size; ++i) {
+			const double values[2]= {
+				max_radial > 0.0 ? radial[i]/max_radial : 0.0,
+				max_angular > 0.0 ? angular[i]/max_angular : 0.0
+			};
+			for (int c= 0; c < 2; ++c) {
+				const double v= values[c];
+				const double encoded= 0.5 + 0.5*(v < 0.0 ? -1.0 : 1.0)*std::sqrt(std::abs(v));
+				row[2*i + c]= (unsigned short)(encoded*65535.0 + 0.5);
+			}
 		}
-		append(amplitude, ")");
+	}
+}
 
-		append(phase_str, "%i.0*phi + (%e)", w->m, w->phase);
+inline
+void testWaveLookup()
+{
+	const int size= waveLookupSize;
+	static unsigned short texels[2*waveLookupSize*Program_maxWaves];
+	Program::Wave waves[2]= {};
+	waves[0].n= 5;
+	waves[0].l= 0;
+	waves[1].n= 4;
+	waves[1].l= 3;
+	waves[1].m= -2;
+	waves[1].phase= 1.0;
+	float scale[Program_maxWaves];
+	const VolumeParams params=
+		createVolumeParams(40, false, 0.0, 0.0, 3.0, true, waves, 2);
+	computeWaveLookup(texels, scale, params);
+	for (std::size_t w= 0; w < params.waveCount; ++w) {
+		assert(scale[w] > 0.0);
+		const HWaveFunc& wave= params.waves[w];
+		const Complex phase= { std::cos(wave.phase), std::sin(wave.phase) };
+		for (int i= 0; i < size; i += 37) {
+			// Decoded amplitude matches psi in the xz-plane, where phi= 0
+			const int j= (i*7) % size;
+			const double r= params.bounds[w][3]*i/(size - 1);
+			const double cos_theta= 2.0*j/(size - 1) - 1.0;
+			const double sin_theta= std::sqrt(std::max(0.0, 1.0 - cos_theta*cos_theta));
+			const double x= r*sin_theta, y= 0.0, z= r*cos_theta;
+			Complex psi;
+			evalHWaveFunc(&psi, &wave, &x, &y, &z, 1);
+			const double expected= psi.a*phase.a + psi.b*phase.b;
+			const double radial= 2.0*texels[2*size*w + 2*i]/65535.0 - 1.0;
+			const double angular= 2.0*texels[2*size*w + 2*j + 1]/65535.0 - 1.0;
+			const double looked_up=
+				radial*std::abs(radial)*angular*std::abs(angular)*std::pow(sin_theta, std::abs(wave.m))*scale[w];
+			assert(std::abs(looked_up - expected) < 1e-4*scale[w]);
+		}
 	}
+}
 
-	//std::printf("Wave function:\n%s\n", amplitude.str);
+/// Uploads the texels of `computeWaveLookup` to the 2D texture `tex_id`, one row per wave
+void uploadWaveLookup(GLuint tex_id, const unsigned short* texels)
+{
+	glBindTexture(GL_TEXTURE_2D, tex_id);
+	glTexImage2D(	GL_TEXTURE_2D, 0, GL_LUMINANCE16_ALPHA16,
+					waveLookupSize, Program_maxWaves,
+					0, GL_LUMINANCE_ALPHA, GL_UNSIGNED_SHORT,
+					texels);
 }
 
-VolumeShader createVolumeShader(
-		const int sample_count,
-		const bool complex_color,
-		const float absorption,
-		const float cutoff,
-		const float visual_brightness,
-		const bool h2_symmetry,
-		const Program::Wave* waves,
-		const std::size_t wave_count)
+const GLchar* volumeVsSrc=
+	"#version 120\n"
+	"attribute vec2 a_pos;"
+	"attribute vec2 a_uv;"
+	"uniform mat4 u_transform;"
+	"varying vec3 v_pos;"
+	"varying vec3 v_normal;"
+	"varying vec2 v_uv;"
+	"void main()"
+	"{"
+	"	gl_Position= vec4(a_pos, 0.0, 1.0);"
+	"	v_pos= (u_transform*vec4(0.0, 0.0, 0.0, 1.0)).xyz;"
+	"	v_normal= mat3(u_transform)*vec3(a_pos, -1.0);"
+	"	v_uv= a_uv;"
+	"}"
+	"\n";
+
+/// Fragment shader is composed of a header defining the macros used below,
+/// `volumeFsCommonSrc`, optional functions, and `volumeFsMainSrc`
+const GLchar* volumeFsCommonSrc=
+	"uniform float u_phase;"
+	"uniform float u_time;"
+	"uniform float u_rayLength;"
+	"uniform vec3 u_color;"
+	"uniform float u_sampleFraction;" // Of SAMPLE_COUNT, fewer while the view moves
+	"uniform vec4 u_bounds[MAX_WAVES];" // Bounding spheres (center, radius), radius is 0 for unused
+	"uniform bool u_skipEmptySpace;" // Otherwise the whole ray is a single cell of weight 1
+	"uniform sampler3D u_occupancy;" // Relative sample density of the cells, see `computeOccupancyGrid`
+	"uniform vec3 u_gridMin;"
+	"uniform vec3 u_gridSize;"
+	"varying vec3 v_pos;"
+	"varying vec3 v_normal;"
+	"varying vec2 v_uv;"
+	"\n#define PI 3.14159265359\n"
+	"float rand(vec2 co)"
+	"{"
+	"    return fract(sin(dot(co.xy, vec2(12.9898,78.233)))*43758.5453);"
+	"}"
+	"float atan2(float y, float x)" // glsl atan(y, x) is undefined if x = 0
+	"{"
+	"	if (abs(x) > abs(y))" /// @todo Remove branch
+	"		return atan(y, x);"
+	"	else"
+	"		return PI/2.0 - atan(x, y);"
+	"}"
+	"vec2 unitPhasor(vec2 c)" // vec2(cos(atan2(c.y, c.x)), sin(atan2(c.y, c.x)))
+	"{"
+	"	float len= length(c);"
+	"	return len > 0.0 ? c/len : vec2(0.0, 1.0);"
+	"}"
+	"\n#define MAX_CELL_STEPS (3*OCCUPANCY_RESO)\n" // Cells crossed by a ray
+	"\n#define MIN_TRANSMITTANCE 1e-3\n"
+	"bool opaque(vec3 intensity, float transmittance)" // Remaining samples are hidden, or the output is saturated
+	"{"
+	"	return transmittance < MIN_TRANSMITTANCE || all(greaterThanEqual(intensity, vec3(1.0)));"
+	"}"
+	"struct CellWalk {" // 3D DDA through the cells of the occupancy grid
+	"	vec3 cell;"
+	"	vec3 step;"
+	"	vec3 tMax;" // Ray distance to the next cell boundary on each axis
+	"	vec3 tDelta;" // Ray distance between cell boundaries on each axis
+	"};"
+	"CellWalk startCellWalk(vec3 origin, vec3 dir)"
+	"{"
+	"	vec3 cell_size= u_gridSize/float(OCCUPANCY_RESO);"
+	"	vec3 abs_dir= max(abs(dir), vec3(1e-12));"
+	"	CellWalk w;"
+	"	w.cell= clamp(floor((origin - u_gridMin)/cell_size), vec3(0.0), vec3(float(OCCUPANCY_RESO - 1)));"
+	"	w.step= sign(dir);"
+	"	w.tMax= abs(u_gridMin + (w.cell + max(w.step, vec3(0.0)))*cell_size - origin)/abs_dir;"
+	"	w.tDelta= cell_size/abs_dir;"
+	"	if (!u_skipEmptySpace)"
+	"		w.tMax= vec3(1e30);"
+	"	return w;"
+	"}"
+	"float cellExit(CellWalk w)"
+	"{"
+	"	return min(min(w.tMax.x, w.tMax.y), w.tMax.z);"
+	"}"
+	"float cellWeight(CellWalk w)" // 0 for empty cells
+	"{"
+	"	if (!u_skipEmptySpace)"
+	"		return 1.0;"
+	"	if (any(lessThan(w.cell, vec3(0.0))) || any(greaterThan(w.cell, vec3(float(OCCUPANCY_RESO - 1)))))"
+	"		return 0.0;"
+	"	return texture3D(u_occupancy, (w.cell + 0.5)/float(OCCUPANCY_RESO)).r;"
+	"}"
+	"void stepCellWalk(inout CellWalk w)"
+	"{"
+	"	if (w.tMax.x <= w.tMax.y && w.tMax.x <= w.tMax.z) {"
+	"		w.cell.x += w.step.x;"
+	"		w.tMax.x += w.tDelta.x;"
+	"	} else if (w.tMax.y <= w.tMax.z) {"
+	"		w.cell.y += w.step.y;"
+	"		w.tMax.y += w.tDelta.y;"
+	"	} else {"
+	"		w.cell.z += w.step.z;"
+	"		w.tMax.z += w.tDelta.z;"
+	"	}"
+	"}"
+	"\n";
+
+const GLchar* volumeFsMainSrc=
+	"void main()"
+	"{"
+	"	vec3 n= normalize(v_normal);"
+	"	float t_near= u_rayLength;" // Samples are spread over the part of the ray inside the bounds
+	"	float t_far= 0.0;"
+	"	for (int b= 0; b < MAX_WAVES; ++b) {"
+	"		vec3 offset= v_pos - u_bounds[b].xyz;"
+	"		float half_b= dot(offset, n);"
+	"		float discriminant= half_b*half_b - dot(offset, offset) + u_bounds[b].w*u_bounds[b].w;"
+	"		if (u_bounds[b].w > 0.0 && discriminant > 0.0) {"
+	"			float root= sqrt(discriminant);"
+	"			t_near= min(t_near, -half_b - root);"
+	"			t_far= max(t_far, -half_b + root);"
+	"		}"
+	"	}"
+	"	t_near= max(t_near, 0.0);"
+	"	t_far= min(t_far, u_rayLength);"
+	"	if (t_near >= t_far)"
+	"		discard;"
+	// Cells are walked from near to far, in the order of compositing. Samples are spread
+	// evenly over the length of the ray weighted by the cells, which skips empty cells
+	"	float ray_len= t_far - t_near;"
+	"	vec3 near_pos= v_pos + t_near*n;"
+	"	float weighted_len= 0.0;"
+	"	CellWalk walk= startCellWalk(near_pos, n);"
+	"	float cell_enter= 0.0;"
+	"	for (int k= 0; k < MAX_CELL_STEPS; ++k) {"
+	"		float cell_exit= min(cellExit(walk), ray_len);"
+	"		weighted_len += cellWeight(walk)*(cell_exit - cell_enter);"
+	"		if (cell_exit >= ray_len)"
+	"			break;"
+	"		stepCellWalk(walk);"
+	"		cell_enter= cell_exit;"
+	"	}"
+	"	if (weighted_len <= 0.0)"
+	"		discard;"
+	"	vec3 color= u_color;"
+	"	vec3 intensity= vec3(0.0, 0.0, 0.0);"
+	"	float transmittance= 1.0;" // Fraction of light from the current sample reaching the eye
+	"	float last_P= 0.0;"
+	"	float depth_sum= 0.0;" // Of ray distances weighted by the contributed intensity
+	"	float depth_weight= 0.0;"
+	"	int sample_count= int(max(1.0, floor(float(SAMPLE_COUNT)*u_sampleFraction + 0.5)));"
+	"	float weighted_dl= weighted_len/float(sample_count);"
+	"	vec3 start_pos= v_pos;"
+	"	float next_sample= rand(v_uv.xy*u_time)*weighted_dl;" // Along the weighted length, from near
+	"	float weighted_before= 0.0;" // Weighted length before the current cell
+	"	int i= 0;"
+	"	walk= startCellWalk(near_pos, n);"
+	"	cell_enter= 0.0;"
+	"	for (int k= 0; k < MAX_CELL_STEPS; ++k) {"
+	"		float cell_exit= min(cellExit(walk), ray_len);"
+	"		float weight= cellWeight(walk);"
+	"		if (weight > 0.0) {"
+	"			float weighted_after= weighted_before + weight*(cell_exit - cell_enter);"
+	"			float dl= weighted_dl/weight;"
+	"			for (int j= 0; j < MAX_SAMPLE_COUNT; ++j) {"
+	"				if (i >= sample_count || next_sample >= weighted_after || opaque(intensity, transmittance))"
+	"					break;"
+	"				float dist= t_near + cell_enter + (next_sample - weighted_before)/weight;"
+	"				float P;"
+	"				vec2 total_phasor;" // e^(i*arg(psi))
+	"				CALC_TOTAL_WAVEFUNC;"
+	"				P *= VISUAL_AMPLITUDE;"
+	"				if (P < CUTOFF) P= 0;"
+	"				vec3 emission= P*color;"
+	"				if (COMPLEX_COLOR)"
+	"					emission= P*normalize(vec3(0.5*(1 - total_phasor.x), 0.2, 0.5*(1 + total_phasor.y)));"
+	"				float absorption= P*ABSORPTION_MUL;"
+	"				vec3 contribution= transmittance*emission*dl;"
+	"				intensity += contribution;"
+	"				depth_sum += dot(contribution, vec3(1.0))*dist;"
+	"				depth_weight += dot(contribution, vec3(1.0));"
+	"				transmittance *= max(0.0, 1.0 - absorption*dl);"
+	"				last_P= P;"
+	"				++i;"
+	"				next_sample += weighted_dl;"
+	"			}"
+	"			weighted_before= weighted_after;"
+	"		}"
+	"		if (cell_exit >= ray_len || i >= sample_count || opaque(intensity, transmittance))"
+	"			break;"
+	"		stepCellWalk(walk);"
+	"		cell_enter= cell_exit;"
+	"	}"
+	// Alpha is the depth at which the ray is seen, for reprojection in `resolveFsSrc`
+	"	float depth= depth_weight > 0.0 ? depth_sum/depth_weight : t_near + 0.5*ray_len;"
+	"	gl_FragColor= vec4(intensity, depth);"
+	"}"
+	"\n";
+
+/// Blends the volume of the current frame (`Program::fbo`) to the resolved image of the previous frame.
+/// If the view has moved, the previous image is reprojected: a pixel is moved by the depth of its ray
+/// to where it was seen in the previous view, and clamped to the spread of colors around the pixel in
+/// the current frame, which rejects history that isn't visible anymore. Otherwise blending is a running
+/// average.
+const GLchar* resolveFsSrc=
+	"#version 120\n"
+	"uniform sampler2D u_current;" // Alpha is depth along the ray
+	"uniform sampler2D u_history;"
+	"uniform mat4 u_transform;"
+	"uniform mat4 u_historyTransform;"
+	"uniform vec2 u_texelSize;"
+	"uniform float u_currentWeight;"
+	"uniform bool u_reproject;"
+	"varying vec2 v_uv;"
+	"void main()"
+	"{"
+	"	vec4 current= texture2D(u_current, v_uv);"
+	"	float weight= u_currentWeight;"
+	"	vec3 history;"
+	"	if (u_reproject) {"
+	"		vec3 origin= (u_transform*vec4(0.0, 0.0, 0.0, 1.0)).xyz;" // Same ray as in `volumeVsSrc`
+	"		vec3 dir= normalize(mat3(u_transform)*vec3(2.0*v_uv - 1.0, -1.0));"
+	"		float depth= current.a > 0.0 ? current.a : dot(-origin, dir);" // Discarded rays are cleared to 0
+	"		vec3 history_origin= (u_historyTransform*vec4(0.0, 0.0, 0.0, 1.0)).xyz;"
+	"		vec3 local_dir= (origin + depth*dir - history_origin)*mat3(u_historyTransform);" // Inverse rotation
+	"		vec2 history_uv= 0.5 - 0.5*local_dir.xy/local_dir.z;"
+	"		if (local_dir.z >= 0.0 || any(lessThan(history_uv, vec2(0.0))) || any(greaterThan(history_uv, vec2(1.0))))"
+	"			weight= 1.0;" // Not seen in the previous view
+	"		vec3 mean= vec3(0.0);" // Of the current neighbourhood, to reject history which no longer matches
+	"		vec3 square_mean= vec3(0.0);"
+	"		for (int y= -1; y <= 1; ++y) {"
+	"			for (int x= -1; x <= 1; ++x) {"
+	"				vec3 c= texture2D(u_current, v_uv + vec2(float(x), float(y))*u_texelSize).rgb;"
+	"				mean += c/9.0;"
+	"				square_mean += c*c/9.0;"
+	"			}"
+	"		}"
+	"		vec3 deviation= sqrt(max(square_mean - mean*mean, vec3(0.0)));"
+	"		history= clamp(texture2D(u_history, history_uv).rgb, mean - deviation, mean + deviation);"
+	"	} else {"
+	"		history= texture2D(u_history, v_uv).rgb;"
+	"	}"
+	"	gl_FragColor= vec4(mix(history, current.rgb, weight), current.a);"
+	"}"
+	"\n";
+
+/// Queries uniform locations and fills the rest of `shd` after `shd.prog` has been created
+void initVolumeShaderLocations(VolumeShader& shd)
+{
+	shd.timeLoc= glGetUniformLocation(shd.prog, "u_time");
+	shd.phaseLoc= glGetUniformLocation(shd.prog, "u_phase");
+	shd.colorLoc= glGetUniformLocation(shd.prog, "u_color");
+	shd.transformLoc= glGetUniformLocation(shd.prog, "u_transform");
+	shd.rayLengthLoc= glGetUniformLocation(shd.prog, "u_rayLength");
+	shd.boundsLoc= glGetUniformLocation(shd.prog, "u_bounds");
+	shd.skipEmptySpaceLoc= glGetUniformLocation(shd.prog, "u_skipEmptySpace");
+	shd.occupancyLoc= glGetUniformLocation(shd.prog, "u_occupancy");
+	shd.gridMinLoc= glGetUniformLocation(shd.prog, "u_gridMin");
+	shd.gridSizeLoc= glGetUniformLocation(shd.prog, "u_gridSize");
+	shd.densityLoc= glGetUniformLocation(shd.prog, "u_density");
+	shd.densityMaxLoc= glGetUniformLocation(shd.prog, "u_densityMax");
+	shd.sampleFractionLoc= glGetUniformLocation(shd.prog, "u_sampleFraction");
+	shd.interferenceLoc= glGetUniformLocation(shd.prog, "u_interference");
+	shd.moleculeNLoc= glGetUniformLocation(shd.prog, "u_moleculeN");
+
+	// Only in generic shader
+	shd.sampleCountLoc= glGetUniformLocation(shd.prog, "u_sampleCount");
+	shd.complexColorLoc= glGetUniformLocation(shd.prog, "u_complexColor");
+	shd.absorptionLoc= glGetUniformLocation(shd.prog, "u_absorptionMul");
+	shd.cutoffLoc= glGetUniformLocation(shd.prog, "u_cutoff");
+	shd.visualAmplitudeLoc= glGetUniformLocation(shd.prog, "u_visualAmplitude");
+	shd.symmetryLoc= glGetUniformLocation(shd.prog, "u_symmetry");
+	shd.waveCountLoc= glGetUniformLocation(shd.prog, "u_waveCount");
+	shd.moleculeLoc= glGetUniformLocation(shd.prog, "u_molecule");
+	shd.normalizationLoc= glGetUniformLocation(shd.prog, "u_normalization");
+	shd.rhoMulLoc= glGetUniformLocation(shd.prog, "u_rhoMul");
+	shd.lLoc= glGetUniformLocation(shd.prog, "u_l");
+	shd.absMLoc= glGetUniformLocation(shd.prog, "u_absM");
+	shd.mLoc= glGetUniformLocation(shd.prog, "u_m");
+	shd.wavePhaseLoc= glGetUniformLocation(shd.prog, "u_wavePhase");
+	shd.wavePhasorLoc= glGetUniformLocation(shd.prog, "u_wavePhasor");
+	shd.translationLoc= glGetUniformLocation(shd.prog, "u_translation");
+	shd.laguerreCoeffLoc= glGetUniformLocation(shd.prog, "u_laguerreCoeff");
+	shd.legendreCoeffLoc= glGetUniformLocation(shd.prog, "u_legendreCoeff");
+	shd.waveLookupLoc= glGetUniformLocation(shd.prog, "u_waveLookup");
+	shd.lookupScaleLoc= glGetUniformLocation(shd.prog, "u_lookupScale");
+}
+
+inline
+void testVolumeShaders()
 {
 #ifdef DEBUG
 	testMath();
-	if (wave_count > 0) {
-		HWaveFunc wf= createHWaveFunc(
-				waves[0].n,
-				waves[0].l,
-				waves[0].m,
-				waves[0].phase);
-		double max_r= 5.0*std::pow(waves[0].n, 2.0); // Empirical value
-		Complex I= interferenceIntegral(&wf, &wf, max_r, 0.0);
-		std::printf("<psi|psi>: %f, %f\n", I.a, I.b);
-	}
+	testFastMath();
+	testExpr();
+	testHWaveFunc();
+	testOrbitalExtent();
+	testElectronSampler();
+	testOccupancyGrid();
+	testDensityTexture();
+	testWaveLookup();
 #endif
+}
 
-	String hydrogen_amplitudes[Program_maxWaves]= {}; // Real multiplier
-	String hydrogen_phases[Program_maxWaves]= {}; // Complex phase
-	HWaveFunc hwavefuncs[Program_maxWaves]= {};
-	bool molecule= false;
-	for (std::size_t wave_i= 0; wave_i < wave_count; ++wave_i) {
-		hydrogen_amplitudes[wave_i]= createString();
-		hydrogen_phases[wave_i]= createString();
-		hwavefuncs[wave_i]= createHWaveFunc(
-				waves[wave_i].n,
-				waves[wave_i].l,
-				waves[wave_i].m,
-				waves[wave_i].phase);
-		hydrogenWaveFuncStr(
-				&hwavefuncs[wave_i],
-				&hydrogen_amplitudes[wave_i],
-				&hydrogen_phases[wave_i]);
-		if (wave_count > 1 && waves[wave_i].translation != 0.0)
-			molecule= true;
-	}
+/// Macros of the fragment shader with `params` baked in
+void appendVolumeFsHeader(String* fs, const VolumeParams& params, const char* calc_total_wavefunc_define)
+{
+	append(fs,
+		"#version 120\n"
+		"#define MAX_WAVES %i\n"
+		"#define OCCUPANCY_RESO %i\n"
+		"#define SAMPLE_COUNT %i\n"
+		"#define MAX_SAMPLE_COUNT SAMPLE_COUNT\n"
+		"#define COMPLEX_COLOR %s\n"
+		"#define ABSORPTION_MUL %e\n"
+		"#define CUTOFF %e\n"
+		"#define VISUAL_AMPLITUDE %e\n"
+		"#define SPACE_PART_SYMMETRY %s\n"
+		"%s\n",
+		(int)Program_maxWaves,
+		occupancyGridReso,
+		params.sampleCount,
+		params.complexColor ? "true" : "false",
+		params.absorption,
+		params.cutoff,
+		params.visualAmplitude,
+		params.h2Symmetry ? "+" : "-",
+		calc_total_wavefunc_define);
+}
 
+/// Fragment shader source with `params` baked in
+void volumeFsSource(String* fs, const VolumeParams& params)
+{
+	Expr e= {};
+	int roots[2*Program_maxWaves]= {};
+	const std::size_t wave_count= params.waveCount;
 	String calc_total_wavefunc_define= createString();
 	append(&calc_total_wavefunc_define, "#define CALC_TOTAL_WAVEFUNC ");
-	if (molecule) {
+	if (params.molecule) {
 		// H2 molecule rendering
 		// |psi_total| = |psi_1|^2 + |psi_2|^2 +- interference
-		assert(wave_count == 2 && "Molecule visualization only supported for exactly two wavefuncs");
-
-		const double max_r= 5.0*std::pow(waves[0].n, 2.0); // Empirical value
-		const Complex interference= interferenceIntegral(
-				&hwavefuncs[0], &hwavefuncs[1], max_r,
-				waves[1].translation - waves[0].translation);
-		std::printf("<psi_1|psi_2>: %f, %f\n", interference.a, interference.b);
-
-		const double n_int_part= H2_N_integralPart(
-				&hwavefuncs[0], &hwavefuncs[1], interference, max_r,
-				waves[1].translation - waves[0].translation);
-		double N= 1.0/(2.0 + (h2_symmetry ? 1 : -1)*2.0*n_int_part);
-		if (N < 0.0)
-			N= 0; // Happens when antisymmetric electrons are really close
-		std::printf("N: %f\n", N);
-
-		append(&calc_total_wavefunc_define, "%s",
-				"vec3 cart_p;"
-				"float r, phi, cos_theta, theta, sin_theta;");
 		for (int i= 0; i < (int)wave_count; ++i) {
+			char pos[16];
+			std::snprintf(pos, sizeof(pos), "cart_p_%i", i);
 			append(&calc_total_wavefunc_define,
-					"cart_p= start_pos + n*dist + vec3(0.0, 0.0, %e);"
-					"r= sqrt(dot(cart_p, cart_p));"
-					"phi= atan2(cart_p.y, cart_p.x);"
-					"cos_theta= cart_p.z/r;"
-					"theta= acos(cos_theta);"
-					"sin_theta= sin(theta);"
-					"float a_%i= (%s);" // Can be negative
-					"float p_%i= (%s);" // Not taking account possible negative amplitude
-					"float real_%i = a_%i*cos(p_%i);"
-					"float imag_%i = a_%i*sin(p_%i);",
-					waves[i].translation,
-					i, hydrogen_amplitudes[i].str,
-					i, hydrogen_phases[i].str,
-					i, i, i,
-					i, i, i);
+					"vec3 %s= start_pos + n*dist + vec3(0.0, 0.0, %e);",
+					pos, params.translations[i]);
+			hydrogenWaveFuncExpr(e, &params.waves[i], pos, &roots[2*i], &roots[2*i + 1]);
 		}
 
-		append(&calc_total_wavefunc_define,
-				"const float real_int= %e;"
-				"const float imag_int= %e;"
-				"float real_interf= real_0*real_1*real_int + imag_0*imag_1*real_int"
-				"					- real_0*imag_1*imag_int + real_1*imag_0*imag_int;"
-				"P= %e*(real_0*real_0 + imag_0*imag_0 + real_1*real_1 + imag_1*imag_1 SPACE_PART_SYMMETRY 2*real_interf);"
-				"total_complex_phase= atan2(imag_0 + imag_1, real_0 + real_1);",
-				interference.a, interference.b, N);
+		appendExprTemporaries(&calc_total_wavefunc_define, e, roots, 2*wave_count);
+		for (int i= 0; i < (int)wave_count; ++i) {
+			append(&calc_total_wavefunc_define, "float real_%i= ", i);
+			appendExprGlsl(&calc_total_wavefunc_define, e, roots[2*i]);
+			append(&calc_total_wavefunc_define, ";float imag_%i= ", i);
+			appendExprGlsl(&calc_total_wavefunc_define, e, roots[2*i + 1]);
+			append(&calc_total_wavefunc_define, ";");
+		}
+
+		append(&calc_total_wavefunc_define, "%s",
+				"float real_interf= (real_0*real_1 + imag_0*imag_1)*u_interference.x"
+				"					+ (real_1*imag_0 - real_0*imag_1)*u_interference.y;"
+				"P= u_moleculeN*(real_0*real_0 + imag_0*imag_0 + real_1*real_1 + imag_1*imag_1 SPACE_PART_SYMMETRY 2*real_interf);"
+				"total_phasor= unitPhasor(vec2(real_0 + real_1, imag_0 + imag_1));");
 
 	} else {
 		// Superposition rendering
 		// |psi_total| = |psi_1|^2 + |psi_2|^2
-		append(&calc_total_wavefunc_define, "%s",
-				"vec3 cart_p= start_pos + n*dist;"
-				"float r, phi, cos_theta, theta, sin_theta;"
-				"float total_real= 0;"
-				"float total_imag= 0;");
+		append(&calc_total_wavefunc_define, "%s", "vec3 cart_p= start_pos + n*dist;");
+		int total_real= exprConst(e, 0.0);
+		int total_imag= exprConst(e, 0.0);
 		for (int i= 0; i < (int)wave_count; ++i) {
-			append(&calc_total_wavefunc_define,
-				"r= sqrt(dot(cart_p, cart_p));"
-				"phi= atan2(cart_p.y, cart_p.x);"
-				"cos_theta= cart_p.z/r;"
-				"theta= acos(cos_theta);"
-				"sin_theta= sin(theta);"
-				"float a_%i= (%s);" // Can be negative
-				"float p_%i= (%s);" // Not taking account possible negative amplitude
-				"total_real += a_%i*cos(p_%i);"
-				"total_imag += a_%i*sin(p_%i);",
-				i, hydrogen_amplitudes[i].str,
-				i, hydrogen_phases[i].str,
-				i, i,
-				i, i);
+			int real, imag;
+			hydrogenWaveFuncExpr(e, &params.waves[i], "cart_p", &real, &imag);
+			total_real= exprAdd(e, total_real, real);
+			total_imag= exprAdd(e, total_imag, imag);
 		}
+		roots[0]= total_real;
+		roots[1]= total_imag;
+
+		appendExprTemporaries(&calc_total_wavefunc_define, e, roots, 2);
+		append(&calc_total_wavefunc_define, "float total_real= ");
+		appendExprGlsl(&calc_total_wavefunc_define, e, total_real);
+		append(&calc_total_wavefunc_define, ";float total_imag= ");
+		appendExprGlsl(&calc_total_wavefunc_define, e, total_imag);
 		append(&calc_total_wavefunc_define, "%s",
+				";"
 				"P= total_real*total_real + total_imag*total_imag;"
-				"total_complex_phase= atan2(total_imag, total_real);");
+				"total_phasor= unitPhasor(vec2(total_real, total_imag));");
 	}
 
-	const GLchar* vs_src=
+	appendVolumeFsHeader(fs, params, calc_total_wavefunc_define.str);
+	if (params.molecule) // Integrals are uniforms, so they don't need to be known for the source
+		append(fs, "%s", "uniform vec2 u_interference;uniform float u_moleculeN;\n");
+	append(fs, "%s%s", volumeFsCommonSrc, volumeFsMainSrc);
+
+	destroyString(calc_total_wavefunc_define);
+}
+
+/// Fragment shader source which looks the state up from the density texture (see `computeDensityTexture`)
+/// instead of evaluating the waves, so the cost of a sample doesn't depend on n or the number of waves.
+/// Waves aren't baked in, so the source changes only with the other `params`
+void densityTextureVolumeFsSource(String* fs, const VolumeParams& params)
+{
+	appendVolumeFsHeader(fs, params,
+		"#define CALC_TOTAL_WAVEFUNC densityFromTexture(start_pos + n*dist, P, total_phasor)");
+
+	const GLchar* density_src=
+		"uniform sampler3D u_density;"
+		"uniform float u_densityMax;" // P of amplitude 1 in the texture
+		"void densityFromTexture(vec3 p, out float P, out vec2 total_phasor)"
+		"{"
+		"	vec3 texel= texture3D(u_density, (p - u_gridMin)/u_gridSize).rgb;"
+		"	P= texel.r*texel.r*u_densityMax;"
+		"	total_phasor= unitPhasor(2.0*texel.gb - 1.0);"
+		"}"
+		"\n";
+
+	append(fs, "%s%s%s", volumeFsCommonSrc, density_src, volumeFsMainSrc);
+}
+
+/// Fragment shader source which takes all of `VolumeParams` as uniforms (see `setGenericVolumeUniforms`),
+/// so it needs to be compiled only once. Supports n <= genericShaderMaxN
+/// @param wave_lookup Waves are looked up from the wave lookup texture (see `computeWaveLookup`)
+///                    instead of evaluating the polynomials
+void genericVolumeFsSource(String* fs, bool wave_lookup)
+{
+	append(fs,
 		"#version 120\n"
-		"attribute vec2 a_pos;"
-		"attribute vec2 a_uv;"
-		"uniform mat4 u_transform;"
-		"varying vec3 v_pos;"
-		"varying vec3 v_normal;"
-		"varying vec2 v_uv;"
-		"void main()"
+		"#define MAX_WAVES %i\n"
+		"#define OCCUPANCY_RESO %i\n"
+		"#define MAX_TERMS %i\n"
+		"#define WAVE_LOOKUP_SIZE %i\n"
+		"#define MAX_SAMPLE_COUNT %i\n"
+		"#define SAMPLE_COUNT u_sampleCount\n"
+		"#define COMPLEX_COLOR u_complexColor\n"
+		"#define ABSORPTION_MUL u_absorptionMul\n"
+		"#define CUTOFF u_cutoff\n"
+		"#define VISUAL_AMPLITUDE u_visualAmplitude\n"
+		"#define CALC_TOTAL_WAVEFUNC calcTotalWaveFunc(start_pos + n*dist, P, total_phasor)\n",
+		(int)Program_maxWaves,
+		occupancyGridReso,
+		genericShaderMaxN,
+		waveLookupSize,
+		Program_maxSampleCount);
+
+	const GLchar* params_src=
+		"uniform int u_sampleCount;"
+		"uniform bool u_complexColor;"
+		"uniform float u_absorptionMul;"
+		"uniform float u_cutoff;"
+		"uniform float u_visualAmplitude;"
+		"uniform float u_symmetry;" // +-1
+		"uniform int u_waveCount;"
+		"uniform bool u_molecule;"
+		"uniform vec2 u_interference;"
+		"uniform float u_moleculeN;"
+		"uniform float u_normalization[MAX_WAVES];"
+		"uniform float u_rhoMul[MAX_WAVES];"
+		"uniform int u_l[MAX_WAVES];"
+		"uniform int u_absM[MAX_WAVES];"
+		"uniform float u_m[MAX_WAVES];"
+		"uniform float u_wavePhase[MAX_WAVES];"
+		"uniform float u_translation[MAX_WAVES];"
+		"\n";
+
+	const GLchar* eval_wave_src=
+		"uniform float u_laguerreCoeff[MAX_WAVES*MAX_TERMS];" // Unused terms are zero
+		"uniform float u_legendreCoeff[MAX_WAVES*MAX_TERMS];"
+		"vec2 evalWave(int w, vec3 p)" // Real and imaginary part
 		"{"
-		"	gl_Position= vec4(a_pos, 0.0, 1.0);"
-		"	v_pos= (u_transform*vec4(0.0, 0.0, 0.0, 1.0)).xyz;"
-		"	v_normal= mat3(u_transform)*vec3(a_pos, -1.0);"
-		"	v_uv= a_uv;"
+		"	float r= max(length(p), 1e-20);" // Direction is arbitrary at the origin
+		"	float rho= u_rhoMul[w]*r;"
+		"	float cos_theta= p.z/r;"
+		"	float sin_theta= sqrt(max(0.0, 1.0 - cos_theta*cos_theta));"
+		"	float lag= 0.0;"
+		"	float leg= 0.0;"
+		"	for (int i= MAX_TERMS - 1; i >= 0; --i) {"
+		"		lag= lag*rho + u_laguerreCoeff[w*MAX_TERMS + i];"
+		"		leg= leg*cos_theta + u_legendreCoeff[w*MAX_TERMS + i];"
+		"	}"
+		"	float sin_pow= u_absM[w] == 0 ? 1.0 : pow(sin_theta, float(u_absM[w]));" // pow(0, 0) is undefined
+		"	float rho_pow= u_l[w] == 0 ? 1.0 : pow(rho, float(u_l[w]));"
+		"	float a= u_normalization[w]*exp(-0.5*rho)*rho_pow*lag*sin_pow*leg;"
+		"	float phase= u_m[w]*atan2(p.y, p.x) + u_wavePhase[w];"
+		"	return a*vec2(cos(phase), sin(phase));"
 		"}"
 		"\n";
-	const GLchar* fs_template_src=
-		"uniform float u_phase;"
-		"uniform float u_time;"
-		"uniform float u_rayLength;"
-		"uniform vec3 u_color;"
-		"varying vec3 v_pos;"
-		"varying vec3 v_normal;"
-		"varying vec2 v_uv;"
-		"\n#define PI 3.14159265359\n"
-		"float rand(vec2 co)"
+
+	const GLchar* lookup_wave_src=
+		"uniform sampler2D u_waveLookup;" // Row per wave
+		"uniform float u_lookupScale[MAX_WAVES];"
+		"uniform vec2 u_wavePhasor[MAX_WAVES];" // e^(i*phase)
+		"\n#define LOOKUP_COORD(u) (((u)*float(WAVE_LOOKUP_SIZE - 1) + 0.5)/float(WAVE_LOOKUP_SIZE))\n"
+		"float decodeLookup(float texel)" // Inverse of 0.5 + 0.5*sign(v)*sqrt(|v|)
 		"{"
-		"    return fract(sin(dot(co.xy, vec2(12.9898,78.233)))*43758.5453);"
+		"	float v= 2.0*texel - 1.0;"
+		"	return v*abs(v);"
 		"}"
-		"float atan2(float y, float x)" // glsl atan(y, x) is undefined if x = 0
+		"vec2 evalWave(int w, vec3 p)" // Real and imaginary part
 		"{"
-		"	if (abs(x) > abs(y))" /// @todo Remove branch
-		"		return atan(y, x);"
-		"	else"
-		"		return PI/2.0 - atan(x, y);"
+		"	float r= max(length(p), 1e-20);"
+		"	if (r >= u_bounds[w].w)"
+		"		return vec2(0.0);"
+		"	float row= (float(w) + 0.5)/float(MAX_WAVES);"
+		"	float radial= decodeLookup(texture2D(u_waveLookup, vec2(LOOKUP_COORD(r/u_bounds[w].w), row)).r);"
+		"	float angular= decodeLookup(texture2D(u_waveLookup, vec2(LOOKUP_COORD(0.5 + 0.5*p.z/r), row)).a);"
+		"	vec2 q= vec2(p.x, u_m[w] < 0.0 ? -p.y : p.y)/r;" // sin(theta)*e^(+-i*phi)
+		"	vec2 phasor= u_wavePhasor[w];"
+		"	for (int k= 0; k < MAX_TERMS; ++k) {" // phasor*q^|m|, |m| < n <= MAX_TERMS
+		"		if (k >= u_absM[w])"
+		"			break;"
+		"		phasor= vec2(phasor.x*q.x - phasor.y*q.y, phasor.x*q.y + phasor.y*q.x);"
+		"	}"
+		"	return u_lookupScale[w]*radial*angular*phasor;"
 		"}"
-		"void main()"
+		"\n";
+
+	const GLchar* total_wavefunc_src=
+		"void calcTotalWaveFunc(vec3 p, out float P, out vec2 total_phasor)"
 		"{"
-		"	vec3 n= normalize(v_normal);"
-		"	vec3 color= u_color;"
-		"	vec3 intensity= vec3(0.0, 0.0, 0.0);"
-		"	float last_P= 0.0;"
-		"	float dl= u_rayLength/SAMPLE_COUNT;"
-		"	vec3 start_pos= v_pos + rand(v_uv.xy*u_time)*n*dl;"
-		"	for (int i= 0; i < SAMPLE_COUNT; ++i) {"
-		"		float dist= u_rayLength*float(SAMPLE_COUNT - i - 1)/float(SAMPLE_COUNT);"
-		"		float P, total_complex_phase;"
-		"		CALC_TOTAL_WAVEFUNC;"
-		"		P *= VISUAL_AMPLITUDE;"
-		"		if (P < CUTOFF) P= 0;"
-		"\n#if COMPLEX_COLOR == 1\n"
-		"		vec3 emission= P*normalize(vec3(0.5*(1 - cos(total_complex_phase)), 0.2, 0.5*(1 + sin(total_complex_phase))));"
-		"\n#else\n"
-		"		vec3 emission= P*color;"
-		"\n#endif\n"
-		"		float absorption= P*ABSORPTION_MUL;"
-		"		intensity=	intensity + (emission - intensity*absorption)*dl;"
-		"		intensity= max(vec3(0.0, 0.0, 0.0), intensity);"
-		"		last_P= P;"
+		"	vec2 total= vec2(0.0, 0.0);"
+		"	if (u_molecule) {" // |psi_total| = |psi_1|^2 + |psi_2|^2 +- interference
+		"		vec2 psi_0= evalWave(0, p + vec3(0.0, 0.0, u_translation[0]));"
+		"		vec2 psi_1= evalWave(1, p + vec3(0.0, 0.0, u_translation[1]));"
+		"		float real_interf= dot(psi_0, psi_1)*u_interference.x +"
+		"				(psi_1.x*psi_0.y - psi_0.x*psi_1.y)*u_interference.y;"
+		"		P= u_moleculeN*(dot(psi_0, psi_0) + dot(psi_1, psi_1) + u_symmetry*2.0*real_interf);"
+		"		total= psi_0 + psi_1;"
+		"	} else {" // |psi_total| = |psi_1|^2 + |psi_2|^2
+		"		if (u_waveCount > 0)" // Unrolled for constant uniform indices
+		"			total += evalWave(0, p);"
+		"		if (u_waveCount > 1)"
+		"			total += evalWave(1, p);"
+		"		P= dot(total, total);"
 		"	}"
-		"	gl_FragColor= vec4(intensity, 1.0);"
+		"	total_phasor= unitPhasor(total);"
 		"}"
 		"\n";
 
-	String buf= createString();
-	append(&buf,
-		"#version 120\n"
-		"#define SAMPLE_COUNT %i\n"
-		"#define COMPLEX_COLOR %i\n"
-		"#define ABSORPTION_MUL %e\n"
-		"#define CUTOFF %e\n"
-		"#define VISUAL_AMPLITUDE %e\n"
-		"#define SPACE_PART_SYMMETRY %s\n"
-		"%s\n",
-		sample_count,
-		complex_color,
-		absorption,
-		cutoff,
-		std::pow(visual_brightness, 5),
-		h2_symmetry ? "+" : "-",
-		calc_total_wavefunc_define.str);
-	const GLchar* fs_src[]= { buf.str, fs_template_src };
-	const GLsizei fs_src_count= sizeof(fs_src)/sizeof(*fs_src);
-
-	VolumeShader shd;
-	createGlShaderProgram(shd.prog, shd.vs, shd.fs, 1, &vs_src, fs_src_count, fs_src);
-	shd.timeLoc= glGetUniformLocation(shd.prog, "u_time");
-	shd.phaseLoc= glGetUniformLocation(shd.prog, "u_phase");
-	shd.colorLoc= glGetUniformLocation(shd.prog, "u_color");
-	shd.transformLoc= glGetUniformLocation(shd.prog, "u_transform");
-	shd.rayLengthLoc= glGetUniformLocation(shd.prog, "u_rayLength");
+	append(fs, "%s%s%s%s%s",
+		volumeFsCommonSrc, params_src, wave_lookup ? lookup_wave_src : eval_wave_src,
+		total_wavefunc_src, volumeFsMainSrc);
+}
 
-	destroyString(buf);
-	destroyString(calc_total_wavefunc_define);
-	for (std::size_t wave_i= 0; wave_i < wave_count; ++wave_i) {
-		destroyString(hydrogen_amplitudes[wave_i]);
-		destroyString(hydrogen_phases[wave_i]);
-	}
+/// Waits for the linking of `shd` to complete
+void finishVolumeShader(VolumeShader& shd)
+{
+	if (shd.linked)
+		return;
+	finishGlShaderProgram(shd.prog, shd.vs, shd.fs, shd.binaryHash, shd.binaryName);
+	initVolumeShaderLocations(shd);
+	shd.linked= true;
+}
+
+/// @return True if `shd` is usable, without blocking
+bool pollVolumeShader(VolumeShader& shd)
+{
+	if (!shd.linked && isGlShaderProgramReady(shd.prog))
+		finishVolumeShader(shd);
+	return shd.linked;
+}
+
+/// Starts compiling a volume shader. Linking completes in the background
+/// with GL_KHR_parallel_shader_compile, otherwise before returning.
+/// @note Without the extension, compiling stalls the render thread. GL objects are created on the
+///       thread of the context, and a link thread would need a second, shared context from each
+///       platform backend of env.cpp. The stall is limited to shaders missing from `shaderCache` and
+///       the program binary cache, and the generic shader avoids it while dragging sliders
+/// @param binary_name See `startGlShaderProgram`
+VolumeShader createVolumeShader(const char* fs_src, bool generic, const char* binary_name)
+{
+	VolumeShader shd= {};
+	shd.binaryName= binary_name;
+	startGlShaderProgram(	shd.prog, shd.vs, shd.fs, shd.binaryHash, binary_name,
+							1, &volumeVsSrc, 1, &fs_src);
+	shd.generic= generic;
+	if (!g_parallelShaderCompile)
+		finishVolumeShader(shd);
 	return shd;
 }
 
+/// Returns a shader compiled from `fs_src`, reusing a cached program if the source has been seen before
+/// Program `in_use` is never evicted.
+/// @param binary_name See `startGlShaderProgram`
+/// @note Program is owned by the cache. Returned pointer is valid until the next call
+VolumeShader* cachedVolumeShader(	VolumeShaderCache& cache, const char* fs_src, bool generic,
+									GLuint in_use, const char* binary_name= NULL)
+{
+	const uint64_t hash= hashFnv1a(fs_src, std::strlen(fs_src));
+	++cache.useCount;
+	for (std::size_t i= 0; i < cache.entries.size; ++i) {
+		VolumeShaderCache::Entry& e= cache.entries.data[i];
+		if (e.hash == hash && e.shader.generic == generic) {
+			e.lastUse= cache.useCount;
+			return &e.shader;
+		}
+	}
+
+	VolumeShaderCache::Entry entry= { hash, cache.useCount, createVolumeShader(fs_src, generic, binary_name) };
+	if (cache.entries.size < Program_volumeShaderCacheSize) {
+		push(cache.entries, entry);
+		return &last(cache.entries).shader;
+	}
+
+	VolumeShaderCache::Entry* lru= NULL;
+	for (std::size_t i= 0; i < cache.entries.size; ++i) {
+		VolumeShaderCache::Entry& e= cache.entries.data[i];
+		if (e.shader.prog != in_use && (!lru || e.lastUse < lru->lastUse))
+			lru= &e;
+	}
+	destroyGlShaderProgram(lru->shader.prog, lru->shader.vs, lru->shader.fs);
+	*lru= entry;
+	return &lru->shader;
+}
+
+void destroyVolumeShaderCache(VolumeShaderCache& cache)
+{
+	for (std::size_t i= 0; i < cache.entries.size; ++i) {
+		const VolumeShader& shd= cache.entries.data[i].shader;
+		destroyGlShaderProgram(shd.prog, shd.vs, shd.fs);
+	}
+	cache.entries.size= 0;
+}
+
+/// @note Shader must be in use
+void setGenericVolumeUniforms(const VolumeShader& shd, const VolumeParams& params)
+{
+	assert(shd.generic);
+	const int terms= genericShaderMaxN;
+	GLfloat normalization[Program_maxWaves]= {};
+	GLfloat rho_mul[Program_maxWaves]= {};
+	GLint l[Program_maxWaves]= {};
+	GLint abs_m[Program_maxWaves]= {};
+	GLfloat m[Program_maxWaves]= {};
+	GLfloat phase[Program_maxWaves]= {};
+	GLfloat phasor[2*Program_maxWaves]= {};
+	GLfloat translation[Program_maxWaves]= {};
+	GLfloat laguerre_coeff[Program_maxWaves*genericShaderMaxN]= {};
+	GLfloat legendre_coeff[Program_maxWaves*genericShaderMaxN]= {};
+	for (std::size_t i= 0; i < params.waveCount; ++i) {
+		const HWaveFunc& w= params.waves[i];
+		assert(w.n <= genericShaderMaxN);
+		normalization[i]= w.normalization;
+		rho_mul[i]= 2.0/(w.n*bohrRadius);
+		l[i]= w.l;
+		abs_m[i]= std::abs(w.m);
+		m[i]= w.m;
+		phase[i]= w.phase;
+		phasor[2*i]= std::cos(w.phase);
+		phasor[2*i + 1]= std::sin(w.phase);
+		translation[i]= params.translations[i];
+		for (int k= 0; k < terms; ++k) {
+			laguerre_coeff[i*terms + k]= w.laguerreCoeff[k];
+			legendre_coeff[i*terms + k]= w.spheCoeff[k];
+		}
+	}
+
+	glUniform1i(shd.sampleCountLoc, params.sampleCount);
+	glUniform1i(shd.complexColorLoc, params.complexColor);
+	glUniform1f(shd.absorptionLoc, params.absorption);
+	glUniform1f(shd.cutoffLoc, params.cutoff);
+	glUniform1f(shd.visualAmplitudeLoc, params.visualAmplitude);
+	glUniform1f(shd.symmetryLoc, params.h2Symmetry ? 1.0 : -1.0);
+	glUniform1i(shd.waveCountLoc, (GLint)params.waveCount);
+	glUniform1i(shd.moleculeLoc, params.molecule);
+	glUniform1fv(shd.normalizationLoc, Program_maxWaves, normalization);
+	glUniform1fv(shd.rhoMulLoc, Program_maxWaves, rho_mul);
+	glUniform1iv(shd.lLoc, Program_maxWaves, l);
+	glUniform1iv(shd.absMLoc, Program_maxWaves, abs_m);
+	glUniform1fv(shd.mLoc, Program_maxWaves, m);
+	glUniform1fv(shd.wavePhaseLoc, Program_maxWaves, phase);
+	glUniform2fv(shd.wavePhasorLoc, Program_maxWaves, phasor);
+	glUniform1fv(shd.translationLoc, Program_maxWaves, translation);
+	glUniform1fv(shd.laguerreCoeffLoc, Program_maxWaves*terms, laguerre_coeff);
+	glUniform1fv(shd.legendreCoeffLoc, Program_maxWaves*terms, legendre_coeff);
+}
+
 VolumeFbo createFbo(Vec2i reso, bool filtering)
 {
 	GLenum filter= filtering ? GL_LINEAR : GL_NEAREST;
@@ -633,9 +2508,9 @@ VolumeFbo createFbo(Vec2i reso, bool filtering)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-	glTexImage2D(	GL_TEXTURE_2D, 0, GL_RGB,
+	glTexImage2D(	GL_TEXTURE_2D, 0, GL_RGBA32F,
 					fbo.reso.x, fbo.reso.y,
-					0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+					0, GL_RGBA, GL_FLOAT, NULL);
 
 	glGenFramebuffers(1, &fbo.fboId);
 	glBindFramebuffer(GL_FRAMEBUFFER, fbo.fboId);
@@ -670,30 +2545,218 @@ void addWave(Program& prog)
 	push(prog.sliders, translation);
 }
 
-void createVolumeShaderForProgram(Program* prog)
+/// Switches to `prog->pendingShader` if it has been linked
+void updateVolumeShader(Program* prog)
 {
-	Program::Wave used_waves[Program_maxWaves]= {};
-	Program::Wave* next_wave= used_waves;
+	if (prog->pendingShader && pollVolumeShader(*prog->pendingShader)) {
+		prog->shader= *prog->pendingShader;
+		prog->pendingShader= NULL;
+		prog->accumulatedFrames= 0;
+	}
+}
+
+/// Copies the waves with n > 0 to `used_waves`
+/// @return Number of the used waves
+std::size_t usedWaves(const Program* prog, Program::Wave* used_waves)
+{
+	std::size_t count= 0;
 	for (std::size_t i= 0; i < prog->waves.size; ++i) {
 		if (prog->waves.data[i].n > 0)
-			*next_wave++ = prog->waves.data[i];
+			used_waves[count++]= prog->waves.data[i];
+	}
+	return count;
+}
+
+/// `VolumeParams` for the current slider values
+/// Bounds and integrals are reused from `prog->volumeParams` when the waves haven't changed
+/// @param integrals Compute the molecule integrals, which the shader sources don't depend on
+VolumeParams volumeParamsForProgram(const Program* prog, bool integrals= true)
+{
+	Program::Wave used_waves[Program_maxWaves]= {};
+	const std::size_t wave_count= usedWaves(prog, used_waves);
+	return	createVolumeParams(
+				prog->sampleCount,
+				prog->complexColor,
+				prog->absorption,
+				prog->cutoff,
+				prog->brightness,
+				prog->h2Symmetry,
+				used_waves, wave_count,
+				integrals,
+				&prog->volumeParams);
+}
+
+/// Starts computing `VolumeUpdate` for the current slider values on a worker thread:
+/// the params with the integrals and the orbital extents, and the textures which are out of date.
+/// `finishVolumeUpdate` applies the result on the render thread, as GL calls must be made there
+void startVolumeUpdate(Program* prog)
+{
+	VolumeUpdate& u= prog->volumeUpdate;
+	assert(!u.thread.joinable());
+	u.done= false;
+	u.sampling= prog->sampling;
+	u.precompute= prog->precompute;
+	u.genericShader= prog->genericShader;
+
+	// Worker uses copies, as the sliders keep changing
+	Program::Wave waves[Program_maxWaves]= {};
+	const std::size_t wave_count= usedWaves(prog, waves);
+	const VolumeParams previous= prog->volumeParams;
+	const int sample_count= prog->sampleCount;
+	const bool complex_color= prog->complexColor;
+	const float absorption= prog->absorption;
+	const float cutoff= prog->cutoff;
+	const float brightness= prog->brightness;
+	const bool h2_symmetry= prog->h2Symmetry;
+	const float occupancy_sampling= prog->occupancySampling;
+	const bool density_current= prog->densityCurrent;
+	const bool wave_lookup_current= prog->waveLookupCurrent;
+
+	u.thread= std::thread([=, &u]() {
+		u.params= createVolumeParams(
+				sample_count, complex_color, absorption, cutoff, brightness, h2_symmetry,
+				waves, wave_count, true, &previous);
+		u.wavesChanged= !sameWaves(u.params, previous);
+		u.gridChanged=	u.wavesChanged || // Visibility of the cells depends also on these
+						u.params.cutoff != previous.cutoff || u.params.visualAmplitude != previous.visualAmplitude;
+
+		u.occupancy= NULL;
+		if (u.sampling > 0.5 && (u.gridChanged || occupancy_sampling != u.sampling)) {
+			const int reso= occupancyGridReso;
+			u.occupancy= (unsigned char*)std::malloc(reso*reso*reso);
+			computeOccupancyGrid(u.occupancy, u.params, u.sampling > 1.5);
+		}
+
+		const bool density_texture= u.precompute > 1.5;
+		const bool wave_lookup= u.precompute > 0.5 && !density_texture;
+		u.density= NULL;
+		if (density_texture && (u.wavesChanged || !density_current)) {
+			const int reso= densityTextureReso;
+			u.density= (unsigned short*)std::malloc(sizeof(*u.density)*3*reso*reso*reso);
+			u.densityMax= computeDensityTexture(u.density, reso, u.params);
+		}
+		u.waveLookup= NULL;
+		if (wave_lookup && (u.wavesChanged || !wave_lookup_current)) {
+			u.waveLookup=
+				(unsigned short*)std::malloc(sizeof(*u.waveLookup)*2*waveLookupSize*Program_maxWaves);
+			computeWaveLookup(u.waveLookup, u.waveLookupScale, u.params);
+		}
+		u.done= true;
+	});
+}
+
+/// Waits for `startVolumeUpdate`, uploads the new textures, and switches to the shader for
+/// the new params. With the generic shader, changes of the appearance (color, brightness,
+/// absorption, ...) only update `volumeParams`, which are uploaded as uniforms when drawing
+void finishVolumeUpdate(Program* prog)
+{
+	VolumeUpdate& u= prog->volumeUpdate;
+	u.thread.join();
+	if (u.wavesChanged) {
+		prog->densityCurrent= false;
+		prog->waveLookupCurrent= false;
+	}
+	if (u.gridChanged)
+		prog->occupancySampling= 0.0;
+	if (u.occupancy) {
+		uploadOccupancyGrid(prog->occupancyTexId, u.occupancy);
+		prog->occupancySampling= u.sampling;
 	}
+	if (u.density) {
+		uploadDensityTexture(prog->densityTexId, u.density);
+		prog->densityMax= u.densityMax;
+		prog->densityCurrent= true;
+	}
+	if (u.waveLookup) {
+		uploadWaveLookup(prog->waveLookupTexId, u.waveLookup);
+		std::memcpy(prog->waveLookupScale, u.waveLookupScale, sizeof(prog->waveLookupScale));
+		prog->waveLookupCurrent= true;
+	}
+	std::free(u.occupancy);
+	std::free(u.density);
+	std::free(u.waveLookup);
+	u.occupancy= NULL;
+	u.density= NULL;
+	u.waveLookup= NULL;
+	prog->volumeParams= u.params;
+	prog->accumulatedFrames= 0;
+
+	// Wave lookup is a variant of the generic shader, and only it has the lookup texture
+	const bool density_texture= u.precompute > 1.5;
+	const bool wave_lookup= u.precompute > 0.5 && !density_texture;
+	const bool generic= (u.genericShader > 0.5 || wave_lookup) && !density_texture;
+	if (generic && prog->shader.generic && (prog->shader.waveLookupLoc >= 0) == wave_lookup) {
+		prog->pendingShader= NULL;
+		return; // Uniforms are enough
+	}
+
+	String fs= createString();
+	if (density_texture)
+		densityTextureVolumeFsSource(&fs, prog->volumeParams);
+	else if (generic)
+		genericVolumeFsSource(&fs, wave_lookup);
+	else
+		volumeFsSource(&fs, prog->volumeParams);
+	// Only the sources which don't depend on the params are stored on disk
+	const char* binary_name= !generic ? NULL : wave_lookup ? "volume_lookup" : "volume_generic";
+	VolumeShader* shd= cachedVolumeShader(prog->shaderCache, fs.str, generic, prog->shader.prog, binary_name);
+	destroyString(fs);
+
+	// Previous shader is used until the new one has been linked
+	if (!prog->shader.prog)
+		finishVolumeShader(*shd); // Nothing to render meanwhile
+	prog->pendingShader= shd;
+	updateVolumeShader(prog);
+}
+
+/// Updates the params, the textures and the shader for the current slider values, blocking until done
+void createVolumeShaderForProgram(Program* prog)
+{
+	if (prog->volumeUpdate.thread.joinable())
+		finishVolumeUpdate(prog);
+	startVolumeUpdate(prog);
+	finishVolumeUpdate(prog);
+}
 
-	prog->shader=
-		createVolumeShader(
-			prog->sampleCount,
-			prog->complexColor,
-			prog->absorption,
-			prog->cutoff,
-			prog->brightness,
-			prog->h2Symmetry,
-			used_waves, next_wave - used_waves);
+/// Starts compiling the shader for one notch below or above the last changed integer slider,
+/// so that stepping the slider finds the shader in the cache. Call while idle, once per frame.
+/// Only with background compilation, as compiling here would otherwise stall the frame.
+void speculateVolumeShader(Program* prog)
+{
+	if (	!g_parallelShaderCompile || prog->genericShader > 0.5 || prog->precompute > 0.5 ||
+			prog->pendingShader || prog->recompileRequested || prog->volumeUpdate.thread.joinable() ||
+			prog->speculationSlider < 0 || prog->speculationStep >= 2)
+		return;
+
+	Slider& slider= prog->sliders.data[prog->speculationSlider];
+	const float value= *slider.value;
+	const float neighbour= value + (prog->speculationStep == 0 ? -1.0 : 1.0);
+	++prog->speculationStep;
+	if (neighbour < slider.min || neighbour > slider.max)
+		return;
+
+	*slider.value= neighbour;
+	const VolumeParams params= volumeParamsForProgram(prog, false);
+	*slider.value= value;
+
+	String fs= createString();
+	volumeFsSource(&fs, params);
+	cachedVolumeShader(prog->shaderCache, fs.str, false, prog->shader.prog);
+	destroyString(fs);
 }
 
 void init(Env& env, Program& prog)
 {
 	env= envInit();
 	queryGlFuncs();
+	testVolumeShaders(); // Once, not per shader, as the tests take a while
+
+	{ // Shaders are loaded from disk and linked in the background when possible
+		char cache_dir[512];
+		if (envCacheDir(cache_dir, sizeof(cache_dir)))
+			initProgramBinaryCache(cache_dir);
+		initParallelShaderCompile();
+	}
 
 	{ // Font
 		Font& font= prog.font;
@@ -739,16 +2802,17 @@ void init(Env& env, Program& prog)
 						rgba_data);
 	}
 
+	const GLchar* quad_vs_src=
+		"#version 120\n"
+		"attribute vec2 a_pos;"
+		"attribute vec2 a_uv;"
+		"varying vec2 v_uv;"
+		"void main() {"
+		"	v_uv= a_uv;"
+		"	gl_Position= vec4(a_pos, 0.0, 1.0);"
+		"}\n";
+
 	{ // Gui shader
-		const GLchar* vs_src=
-			"#version 120\n"
-			"attribute vec2 a_pos;"
-			"attribute vec2 a_uv;"
-			"varying vec2 v_uv;"
-			"void main() {"
-			"	v_uv= a_uv;"
-			"	gl_Position= vec4(a_pos, 0.0, 1.0);"
-			"}\n";
 		const GLchar* fs_src=
 			"#version 120\n"
 			"uniform sampler2D u_tex;"
@@ -757,11 +2821,23 @@ void init(Env& env, Program& prog)
 			"void main() { gl_FragColor= texture2D(u_tex, v_uv)*u_color; }\n";
 
 		GuiShader& shd= prog.guiShader;
-		createGlShaderProgram(shd.prog, shd.vs, shd.fs, 1, &vs_src, 1, &fs_src);
+		createGlShaderProgram(shd.prog, shd.vs, shd.fs, 1, &quad_vs_src, 1, &fs_src, "gui");
 		shd.texLoc= glGetUniformLocation(shd.prog, "u_tex");
 		shd.colorLoc= glGetUniformLocation(shd.prog, "u_color");
 	}
 
+	{ // Resolve shader
+		ResolveShader& shd= prog.resolveShader;
+		createGlShaderProgram(shd.prog, shd.vs, shd.fs, 1, &quad_vs_src, 1, &resolveFsSrc, "resolve");
+		shd.currentLoc= glGetUniformLocation(shd.prog, "u_current");
+		shd.historyLoc= glGetUniformLocation(shd.prog, "u_history");
+		shd.transformLoc= glGetUniformLocation(shd.prog, "u_transform");
+		shd.historyTransformLoc= glGetUniformLocation(shd.prog, "u_historyTransform");
+		shd.texelSizeLoc= glGetUniformLocation(shd.prog, "u_texelSize");
+		shd.currentWeightLoc= glGetUniformLocation(shd.prog, "u_currentWeight");
+		shd.reprojectLoc= glGetUniformLocation(shd.prog, "u_reproject");
+	}
+
 	{ // Vbo used at rendering quads
 		QuadVbo& vbo= prog.vbo;
 		glGenBuffers(1, &vbo.vboId);
@@ -778,6 +2854,11 @@ void init(Env& env, Program& prog)
 	{ // Program state
 		prog.time= 0.0;
 		prog.phase= 0.0;
+		prog.recompileInterval= 0.25;
+		prog.timeSinceRecompile= 0.0;
+		prog.recompileRequested= false;
+		prog.speculationSlider= -1;
+		prog.speculationStep= 0;
 		prog.sampleCount= 40;
 		prog.resoMul= 0.5;
 		prog.filtering= 0.0;
@@ -789,10 +2870,14 @@ void init(Env& env, Program& prog)
 		prog.cutoff= 0.0;
 		prog.distance= 4.0;
 		prog.brightness= 2.0;
+		prog.genericShader= 1.0;
+		prog.sampling= 0.0;
+		prog.precompute= 0.0;
+		prog.reproject= 0.0;
 
 		Slider default_sliders[] = {
 			{ "Time",			0.0,	5.0,	&prog.phase,			3, false },
-			{ "Samples",		5,		150,	&prog.sampleCount,		0, true },
+			{ "Samples",		5,		Program_maxSampleCount,	&prog.sampleCount,	0, true },
 			{ "Resolution",		0.01,	1.0,	&prog.resoMul,			2, false },
 			{ "Filtering",		0,		1,		&prog.filtering,		0, false },
 			{ "R",				0.0,	2.0,	&prog.r,				3, false },
@@ -803,7 +2888,11 @@ void init(Env& env, Program& prog)
 			{ "Cutoff",			0.0,	0.15,	&prog.cutoff,			4, true },
 			{ "Distance",		0.5,	200.0,	&prog.distance,			4, false },
 			{ "Brightness",		0.0,	10.0,	&prog.brightness,		3, true },
-			{ "H2 symmetry",	0,		1,		&prog.h2Symmetry,		0, true }
+			{ "H2 symmetry",	0,		1,		&prog.h2Symmetry,		0, true },
+			{ "Generic shader",	0,		1,		&prog.genericShader,	0, true },
+			{ "Sampling",		0,		2,		&prog.sampling,			0, true },
+			{ "Precompute",		0,		2,		&prog.precompute,		0, true },
+			{ "Reproject",		0,		1,		&prog.reproject,		0, false }
 		};
 		const std::size_t default_slider_count= sizeof(default_sliders)/sizeof(*default_sliders);
 		for (std::size_t i= 0; i < default_slider_count; ++i)
@@ -812,8 +2901,33 @@ void init(Env& env, Program& prog)
 		addWave(prog);
 		addWave(prog);
 
+		glGenTextures(1, &prog.occupancyTexId);
+		glBindTexture(GL_TEXTURE_3D, prog.occupancyTexId);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP);
+
+		glGenTextures(1, &prog.densityTexId);
+		glBindTexture(GL_TEXTURE_3D, prog.densityTexId);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+
+		glGenTextures(1, &prog.waveLookupTexId);
+		glBindTexture(GL_TEXTURE_2D, prog.waveLookupTexId);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
 		createVolumeShaderForProgram(&prog);
 		prog.fbo= createFbo(env.winSize*prog.resoMul, prog.filtering > 0.5);
+		for (int i= 0; i < 2; ++i)
+			prog.historyFbos[i]= createFbo(prog.fbo.reso, prog.fbo.filtering);
 	}
 
 	{ // Setup initial GL state
@@ -826,13 +2940,25 @@ void init(Env& env, Program& prog)
 
 void quit(Env& env, Program& prog)
 {
+	if (prog.volumeUpdate.thread.joinable()) {
+		prog.volumeUpdate.thread.join();
+		std::free(prog.volumeUpdate.occupancy);
+		std::free(prog.volumeUpdate.density);
+		std::free(prog.volumeUpdate.waveLookup);
+	}
 	destroyFbo(prog.fbo);
-	destroyGlShaderProgram(	prog.shader.prog,
-							prog.shader.vs,
-							prog.shader.fs);
+	for (int i= 0; i < 2; ++i)
+		destroyFbo(prog.historyFbos[i]);
+	glDeleteTextures(1, &prog.occupancyTexId);
+	glDeleteTextures(1, &prog.densityTexId);
+	glDeleteTextures(1, &prog.waveLookupTexId);
+	destroyVolumeShaderCache(prog.shaderCache);
 	destroyGlShaderProgram(	prog.guiShader.prog,
 							prog.guiShader.vs,
 							prog.guiShader.fs);
+	destroyGlShaderProgram(	prog.resolveShader.prog,
+							prog.resolveShader.vs,
+							prog.resolveShader.fs);
 
 	{ // Vbo
 		glDeleteBuffers(1, &prog.vbo.vboId);
@@ -884,16 +3010,34 @@ void frame(const Env& env, Program& prog)
 				slider_activity= true;
 
 				if (value_changed && s.recompile) {
-					destroyGlShaderProgram(	prog.shader.prog,
-											prog.shader.vs,
-											prog.shader.fs);
-					createVolumeShaderForProgram(&prog);
+					prog.recompileRequested= true;
+					if (s.decimals == 0) {
+						prog.speculationSlider= (int)i;
+						prog.speculationStep= 0;
+					}
 				}
 			} else {
 				slider_hover[i]= false;
 			}
 		}
 
+		// Generic shader needs only new uniforms, otherwise the shader is rebuilt at most
+		// once per interval during a drag, and always with the final values on release.
+		// The occupancy grid is evaluated on the CPU, so it's rebuilt at the same pace.
+		// CPU work runs on a worker thread, and requests wait until the previous update is done
+		if (prog.volumeUpdate.thread.joinable() && prog.volumeUpdate.done)
+			finishVolumeUpdate(&prog);
+		prog.timeSinceRecompile += env.dt;
+		const bool cheap_recompile= prog.genericShader > 0.5 && prog.shader.generic && prog.sampling < 0.5;
+		if (	prog.recompileRequested && !prog.volumeUpdate.thread.joinable() &&
+				(!env.lmbDown || cheap_recompile || prog.timeSinceRecompile >= prog.recompileInterval)) {
+			startVolumeUpdate(&prog);
+			prog.recompileRequested= false;
+			prog.timeSinceRecompile= 0.0;
+		}
+		if (!env.lmbDown)
+			speculateVolumeShader(&prog);
+
 		if (env.lmbDown && !slider_activity) {
 			Vec2f smooth_delta= prev_delta*0.5 + (env.cursorDelta)*0.5;
 			prev_delta= smooth_delta;
@@ -921,44 +3065,112 @@ void frame(const Env& env, Program& prog)
 		if (volume_reso != prog.fbo.reso || volume_filtering != prog.fbo.filtering) {
 			destroyFbo(prog.fbo);
 			prog.fbo= createFbo(volume_reso, volume_filtering);
+			for (int i= 0; i < 2; ++i) {
+				destroyFbo(prog.historyFbos[i]);
+				prog.historyFbos[i]= createFbo(volume_reso, volume_filtering);
+			}
+			prog.accumulatedFrames= 0;
 		}
 	}
 
 	glClear(GL_COLOR_BUFFER_BIT);
 
 	{ // Draw volume	
-		// Draw to fbo
-		glBindFramebuffer(GL_FRAMEBUFFER, prog.fbo.fboId);
-		glViewport(0, 0, prog.fbo.reso.x, prog.fbo.reso.y);
-
-		float s1= sin(rot.x), s2= sin(rot.y);
-		float c1= cos(rot.x), c2= cos(rot.y);
-		float r= prog.distance;
-		// Turntable-style rotation
-		float transform[16]= {
-			c1,			0,		s1,		0,
-			-s1*s2,		c2,		c1*s2,	0,
-			-c2*s1,		-s2,	c2*c1,	0,
-			-c2*s1*r,	-s2*r,	c2*c1*r,1 // Translation around origin
-		};
+		// Turntable-style rotation, translation around origin
+		const Mat4f transform_mat=
+			rotationYMat4f(-rot.x)*rotationXMat4f(rot.y)*
+			translationMat4f(Vec3f(0, 0, prog.distance));
+		float transform[16];
+		transform_mat.store(transform);
+
+		// Frames differing only by the jitter of the rays are averaged, which converges to the image
+		// of many samples. When the view rotates, the history is reprojected if enabled, otherwise
+		// discarded. Shader and parameter changes start over in `updateVolumeShader` and
+		// `createVolumeShaderForProgram`
+		const float colors[3]= { prog.r, prog.g, prog.b };
+		const uint64_t color_hash= hashFnv1a(colors, sizeof(colors));
+		if (color_hash != prog.accumulationColorHash) {
+			prog.accumulationColorHash= color_hash;
+			prog.accumulatedFrames= 0;
+		}
+		updateVolumeShader(&prog);
+		bool moved=	prog.accumulatedFrames > 0 &&
+					std::memcmp(transform, prog.historyTransform, sizeof(transform)) != 0;
+		if (moved && prog.reproject < 0.5) {
+			prog.accumulatedFrames= 0;
+			moved= false;
+		}
 
-		VolumeShader& shd= prog.shader;
-		glUseProgram(shd.prog);
-		glUniform1f(shd.timeLoc, prog.time);
-		glUniform1f(shd.phaseLoc, prog.phase);
-		glUniform3f(shd.colorLoc, prog.r, prog.g, prog.b);
-		glUniform1f(shd.rayLengthLoc, prog.distance*2.0);
-		glUniformMatrix4fv(shd.transformLoc, 1, GL_FALSE, transform);
-		drawRect(Vec2f(-1, -1), Vec2f(1, 1));
+		glDisable(GL_BLEND); // Alpha is the depth of the ray
+		if (moved || prog.accumulatedFrames < Program_maxAccumulatedFrames) {
+			// Draw to fbo
+			glBindFramebuffer(GL_FRAMEBUFFER, prog.fbo.fboId);
+			glViewport(0, 0, prog.fbo.reso.x, prog.fbo.reso.y);
+			glClear(GL_COLOR_BUFFER_BIT); // Rays missing the bounds are discarded
+			VolumeShader& shd= prog.shader;
+			glUseProgram(shd.prog);
+			glUniform1f(shd.timeLoc, prog.time);
+			glUniform1f(shd.phaseLoc, prog.phase);
+			glUniform3f(shd.colorLoc, prog.r, prog.g, prog.b);
+			glUniform1f(shd.rayLengthLoc, prog.distance*2.0);
+			glUniformMatrix4fv(shd.transformLoc, 1, GL_FALSE, transform);
+			glUniform4fv(shd.boundsLoc, Program_maxWaves, &prog.volumeParams.bounds[0][0]);
+			glUniform1i(shd.skipEmptySpaceLoc, prog.sampling > 0.5);
+			glBindTexture(GL_TEXTURE_3D, prog.occupancyTexId);
+			glUniform1i(shd.occupancyLoc, 0);
+			const float* grid_min= prog.volumeParams.gridMin;
+			const float* grid_size= prog.volumeParams.gridSize;
+			glUniform3f(shd.gridMinLoc, grid_min[0], grid_min[1], grid_min[2]);
+			glUniform3f(shd.gridSizeLoc, grid_size[0], grid_size[1], grid_size[2]);
+			glActiveTexture(GL_TEXTURE1);
+			glBindTexture(GL_TEXTURE_3D, prog.densityTexId);
+			glActiveTexture(GL_TEXTURE2);
+			glBindTexture(GL_TEXTURE_2D, prog.waveLookupTexId);
+			glActiveTexture(GL_TEXTURE0);
+			glUniform1i(shd.densityLoc, 1);
+			glUniform1f(shd.densityMaxLoc, prog.densityMax);
+			glUniform1i(shd.waveLookupLoc, 2);
+			glUniform1fv(shd.lookupScaleLoc, Program_maxWaves, prog.waveLookupScale);
+			glUniform2f(shd.interferenceLoc, prog.volumeParams.interference.a, prog.volumeParams.interference.b);
+			glUniform1f(shd.moleculeNLoc, prog.volumeParams.moleculeN);
+			if (shd.generic)
+				setGenericVolumeUniforms(shd, prog.volumeParams);
+			glUniform1f(shd.sampleFractionLoc, moved ? Program_motionSampleFraction : 1.0);
+			drawRect(Vec2f(-1, -1), Vec2f(1, 1));
+
+			// Resolve to the other history fbo
+			const VolumeFbo& history= prog.historyFbos[prog.historyIndex];
+			prog.historyIndex= 1 - prog.historyIndex;
+			const ResolveShader& resolve= prog.resolveShader;
+			glBindFramebuffer(GL_FRAMEBUFFER, prog.historyFbos[prog.historyIndex].fboId);
+			glUseProgram(resolve.prog);
+			glBindTexture(GL_TEXTURE_2D, prog.fbo.texId);
+			glActiveTexture(GL_TEXTURE1);
+			glBindTexture(GL_TEXTURE_2D, history.texId);
+			glActiveTexture(GL_TEXTURE0);
+			glUniform1i(resolve.currentLoc, 0);
+			glUniform1i(resolve.historyLoc, 1);
+			glUniformMatrix4fv(resolve.transformLoc, 1, GL_FALSE, transform);
+			glUniformMatrix4fv(resolve.historyTransformLoc, 1, GL_FALSE, prog.historyTransform);
+			glUniform2f(resolve.texelSizeLoc, 1.0/prog.fbo.reso.x, 1.0/prog.fbo.reso.y);
+			glUniform1f(resolve.currentWeightLoc,
+						moved ? Program_motionFrameWeight : 1.0/(prog.accumulatedFrames + 1));
+			glUniform1i(resolve.reprojectLoc, moved);
+			drawRect(Vec2f(-1, -1), Vec2f(1, 1));
+
+			std::memcpy(prog.historyTransform, transform, sizeof(transform));
+			prog.accumulatedFrames= moved ? 1 : prog.accumulatedFrames + 1;
+		}
 
 		// Draw scaled fbo texture
 		glBindFramebuffer(GL_FRAMEBUFFER, 0);
 		glViewport(0, 0, env.winSize.x, env.winSize.y);
-		glBindTexture(GL_TEXTURE_2D, prog.fbo.texId);
+		glBindTexture(GL_TEXTURE_2D, prog.historyFbos[prog.historyIndex].texId);
 		glUseProgram(prog.guiShader.prog);
 		glUniform1i(prog.guiShader.texLoc, 0);
 		glUniform4f(prog.guiShader.colorLoc, 1.0, 1.0, 1.0, 1.0);
 		drawRect(Vec2f(-1, -1), Vec2f(1, 1));
+		glEnable(GL_BLEND);
 	}
 
 	if (slider_activity || !env.lmbDown) { // Draw gui
@@ -1017,8 +3229,19 @@ void frame(const Env& env, Program& prog)
 
 } // qm
 
-int main()
+/// Usage
+///   qm                                      Interactive visualization
+///   qm --sample <n> <l> <m> <count> <file>  Export electron positions of |nlm> as float32 xyz
+int main(int argc, char** argv)
 {
+	if (argc == 7 && std::strcmp(argv[1], "--sample") == 0) {
+		const bool success= qm::exportElectronPositions(
+				argv[6],
+				std::atoi(argv[2]), std::atoi(argv[3]), std::atoi(argv[4]),
+				(std::size_t)std::atoll(argv[5]));
+		return success ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
 	qm::Env env= {};
 	qm::Program prog= {};
 	qm::init(env, prog);
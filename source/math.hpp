@@ -2,11 +2,15 @@
 #define QM_MATH_HPP
 
 #include <cassert>
+#include "util.hpp"
 
 namespace qm {
 
-const double tau= 6.28318530;
-const double pi= tau/2.0;
+constexpr double tau= 6.28318530;
+constexpr double pi= tau/2.0;
+
+/// Size of coefficient arrays of the polynomials in hydrogen wave functions
+const int maxPolyTermCount= 30;
 
 #define CLAMP(v, min, max) (v < (min) ? (min) : v > (max) ? (max) : v)
 
@@ -17,12 +21,47 @@ T round(T v, int decimals= 0)
 	return std::floor(v*mul + 0.5)/mul;
 }
 
-inline
-double fact(double n)
-{ return n > 0 ? n*fact(n - 1) : 1; }
+/// Square root usable in constant expressions
+constexpr double constSqrt(double v)
+{
+	if (v <= 0.0)
+		return 0.0;
+	double x= v > 1.0 ? v : 1.0;
+	for (int i= 0; i < 1100; ++i) { // Newton from above converges monotonically
+		double next= 0.5*(x + v/x);
+		if (next >= x)
+			break;
+		x= next;
+	}
+	return x;
+}
 
-inline
-double binomial(double n, int r)
+/// Factorials up to (factTableSize - 1)! are looked up from `factTable`
+const int factTableSize= 2*maxPolyTermCount;
+
+struct FactTable {
+	double values[factTableSize];
+};
+
+constexpr FactTable createFactTable()
+{
+	FactTable t= {};
+	t.values[0]= 1;
+	for (int i= 1; i < factTableSize; ++i)
+		t.values[i]= i*t.values[i - 1];
+	return t;
+}
+
+constexpr FactTable factTable= createFactTable();
+
+constexpr double fact(int n)
+{
+	return	n <= 0 ? 1 :
+			n < factTableSize ? factTable.values[n] :
+			n*fact(n - 1);
+}
+
+constexpr double binomial(double n, int r)
 {
 	double result= 1;
 	for (int i= 1; i <= r; ++i)
@@ -32,10 +71,41 @@ double binomial(double n, int r)
 	return result;
 }
 
+/// Quantum numbers reachable from the UI (n <= 12) are served from constexpr tables,
+/// larger ones are computed on demand. Keeps the tables small enough for the
+/// default constexpr evaluation limits of every compiler
+const int hydrogenTableSize= 13;
+
+/// Binomial coefficients of integers below binomialTableSize, from Pascal's triangle
+const int binomialTableSize= 2*hydrogenTableSize;
+
+struct BinomialTable {
+	double values[binomialTableSize][binomialTableSize]; // [n][r]
+};
+
+constexpr BinomialTable createBinomialTable()
+{
+	BinomialTable t= {};
+	for (int n= 0; n < binomialTableSize; ++n) {
+		t.values[n][0]= 1;
+		for (int r= 1; r <= n; ++r)
+			t.values[n][r]= t.values[n - 1][r - 1] + t.values[n - 1][r];
+	}
+	return t;
+}
+
+constexpr BinomialTable binomialTable= createBinomialTable();
+
+constexpr double binomial(int n, int r)
+{
+	if (n >= 0 && n < binomialTableSize && r >= 0 && r < binomialTableSize)
+		return binomialTable.values[n][r];
+	return binomial((double)n, r);
+}
+
 /// Generalized Laguerre Polynomials
 /// @param coeff should be size of n + 1, as coeff[n] will contain nth power
-inline
-void laguerre(double* coeff, int n, int alpha)
+constexpr void laguerre(double* coeff, int n, int alpha)
 {
 	int sign= 1;
 	for (int i= 0; i <= n; ++i) {
@@ -45,17 +115,17 @@ void laguerre(double* coeff, int n, int alpha)
 }
 
 /// Legendre polynomials
-/// @param coeff should be size of n + 1, as coeff[n] will contain nth power
-inline
-void legendre(double* coeff, int n)
+/// @param coeff should be size of n + 1, as coeff[n] will contain nth power
+constexpr void legendre(double* coeff, int n)
 {
-	double mul= std::pow(2, n);
+	double mul= 1;
+	for (int i= 0; i < n; ++i)
+		mul *= 2;
 	for (int i= 0; i <= n; ++i)
 		coeff[i]= mul*binomial(n, i)*binomial((i + n - 1)/2.0, n);
 }
 
-inline
-void differentiate(double* coeff, int coeff_size, int diff_count)
+constexpr void differentiate(double* coeff, int coeff_size, int diff_count)
 {
 	for (int i= 0; i < coeff_size; ++i) {
 		if (i + diff_count >= coeff_size)
@@ -68,28 +138,300 @@ void differentiate(double* coeff, int coeff_size, int diff_count)
 /// Coefficients for cosines in spherical harmonics
 /// Embeds plus or minus from the front of Y to the coefficients depending on m
 /// @param cos_coeff should be size of l + 1
-inline
-void sphericalHarmonics(double* cos_coeff, int l, int m)
+constexpr void sphericalHarmonics(double* cos_coeff, int l, int m)
 {
 	assert(l >= 0);
 
-	int m_sign; 
+	int m_sign= 1;
 	if (m >= 0)
 		m_sign= m % 2 ? -1 : 1;
 	else
 		m_sign= 1;
-	m= std::abs(m);
+	m= m < 0 ? -m : m;
 
 	// Calculate coefficients for associated legendre polynomials
 	// P_lm(cos(theta)) = (-1)^m * sin(theta)^m * D^m P_l(cos(theta))
 	legendre(cos_coeff, l);
 	differentiate(cos_coeff, l + 1, m);
-	double normalization= 
-		std::sqrt( (2*l + 1.0)/(4*pi)*fact(l - m)/fact(l + m) );
+	double normalization=
+		constSqrt( (2*l + 1.0)/(4*pi)*fact(l - m)/fact(l + m) );
 	for (int i= 0; i <= l; ++i)
 		cos_coeff[i] *= m_sign*normalization;
 }
 
+/// Coefficients of L(n - l - 1, 2l + 1, rho) for every 0 < n < hydrogenTableSize, l < n
+/// These are the Laguerre polynomials of hydrogen wave functions
+struct LaguerreTable {
+	double coeff[hydrogenTableSize][hydrogenTableSize][hydrogenTableSize]; // [n][l][power]
+};
+
+constexpr LaguerreTable createLaguerreTable()
+{
+	LaguerreTable t= {};
+	for (int n= 1; n < hydrogenTableSize; ++n) {
+		for (int l= 0; l < n; ++l)
+			laguerre(t.coeff[n][l], n - l - 1, 2*l + 1);
+	}
+	return t;
+}
+
+constexpr LaguerreTable laguerreTable= createLaguerreTable();
+
+/// Coefficients of `sphericalHarmonics` for every l < hydrogenTableSize, 0 <= m <= l
+/// The sign embedded for m >= 0 is left out, so that the same row serves -m
+struct SphericalHarmonicsTable {
+	double coeff[hydrogenTableSize][hydrogenTableSize][hydrogenTableSize]; // [l][|m|][power]
+};
+
+constexpr SphericalHarmonicsTable createSphericalHarmonicsTable()
+{
+	SphericalHarmonicsTable t= {};
+	for (int l= 0; l < hydrogenTableSize; ++l) {
+		for (int m= 0; m <= l; ++m)
+			sphericalHarmonics(t.coeff[l][m], l, -m);
+	}
+	return t;
+}
+
+constexpr SphericalHarmonicsTable sphericalHarmonicsTable= createSphericalHarmonicsTable();
+
+/// Table lookup version of `laguerre(coeff, n - l - 1, 2*l + 1)`, computed for n >= hydrogenTableSize
+/// @param coeff should be size of maxPolyTermCount
+constexpr void hydrogenLaguerre(double* coeff, int n, int l)
+{
+	assert(n > 0 && n < maxPolyTermCount && l >= 0 && l < n);
+	for (int i= 0; i < maxPolyTermCount; ++i)
+		coeff[i]= i < hydrogenTableSize && n < hydrogenTableSize ? laguerreTable.coeff[n][l][i] : 0.0;
+	if (n >= hydrogenTableSize)
+		laguerre(coeff, n - l - 1, 2*l + 1);
+}
+
+/// Table lookup version of `sphericalHarmonics`, computed for l >= hydrogenTableSize
+/// @param cos_coeff should be size of maxPolyTermCount
+constexpr void sphericalHarmonicsLookup(double* cos_coeff, int l, int m)
+{
+	const int abs_m= m < 0 ? -m : m;
+	assert(l >= 0 && l < maxPolyTermCount && abs_m <= l);
+	const double m_sign= m >= 0 && m % 2 ? -1 : 1;
+	for (int i= 0; i < maxPolyTermCount; ++i)
+		cos_coeff[i]= i < hydrogenTableSize && l < hydrogenTableSize ? m_sign*sphericalHarmonicsTable.coeff[l][abs_m][i] : 0.0;
+	if (l >= hydrogenTableSize)
+		sphericalHarmonics(cos_coeff, l, m);
+}
+
+/// Factor f for which the theta-dependent part of Y(l, m) with the
+/// conventions of `sphericalHarmonics` equals f*P(l, |m|, cos(theta)),
+/// where P is the associated Legendre function of `associatedLegendreBatch`
+constexpr double sphericalHarmonicsLegendreFactor(int l, int m)
+{
+	const int abs_m= m < 0 ? -m : m;
+	const double normalization=
+		constSqrt( (2*l + 1.0)/(4*pi)*fact(l - abs_m)/fact(l + abs_m) );
+	return m < 0 && abs_m % 2 ? -normalization : normalization;
+}
+
+/// Arguments of batch evaluation functions are processed in blocks of this size
+const int batchBlockSize= 64;
+
+/// Generalized Laguerre polynomial L(n, alpha, x) for `count` arguments
+/// Uses the recurrence (k + 1)L_k+1 = (2k + 1 + alpha - x)L_k - (k + alpha)L_k-1,
+/// which doesn't suffer from the cancellation of summing up the powers of x
+/// @note `result` may be the same array as `x`
+/// @tparam T double or float
+template <typename T>
+void laguerreBatch(T* result, const T* x, int count, int n, double alpha)
+{
+	assert(n >= 0);
+	for (int begin= 0; begin < count; begin += batchBlockSize) {
+		const int size= count - begin < batchBlockSize ? count - begin : batchBlockSize;
+		const T* xb= x + begin;
+		T prev[batchBlockSize];
+		T cur[batchBlockSize];
+		for (int j= 0; j < size; ++j) {
+			prev[j]= 1;
+			cur[j]= (T)(1.0 + alpha) - xb[j];
+		}
+		if (n == 0) {
+			for (int j= 0; j < size; ++j)
+				cur[j]= 1;
+		}
+		for (int k= 1; k < n; ++k) {
+			const T a= (T)(2*k + 1 + alpha);
+			const T b= (T)(k + alpha);
+			const T inv= (T)(1.0/(k + 1));
+			for (int j= 0; j < size; ++j) {
+				T next= ((a - xb[j])*cur[j] - b*prev[j])*inv;
+				prev[j]= cur[j];
+				cur[j]= next;
+			}
+		}
+		for (int j= 0; j < size; ++j)
+			result[begin + j]= cur[j];
+	}
+}
+
+/// Radial part of the hydrogen wave function in float32,
+/// normalization*rho^l*e^(-rho/2)*L(n - l - 1, 2l + 1, rho), for `count` arguments rho >= 0
+/// The factors are combined in log-domain, sign(L)*exp(log(normalization) + l*log(rho) - rho/2 + log|L|),
+/// so that no intermediate over- or underflows float range. For n <= 12 and rho < 1000,
+/// max error is 1e-5 times the peak magnitude of the function (relative error grows near nodes)
+/// Meant for tabulating, like `computeWaveLookup`. Per point it costs two logs and an exp of libm,
+/// about as much as the whole double precision psi of `hWaveFuncBatch`, which needs only one exp
+/// @note `result` may be the same array as `rho`
+inline
+void hydrogenRadialBatch(float* result, const float* rho, int count, int n, int l, double normalization)
+{
+	assert(l >= 0 && l < n && n <= 12);
+	assert(normalization > 0.0);
+	const float log_c= (float)std::log(normalization);
+	for (int begin= 0; begin < count; begin += batchBlockSize) {
+		const int size= count - begin < batchBlockSize ? count - begin : batchBlockSize;
+		const float* rho_b= rho + begin;
+		float lag[batchBlockSize];
+		laguerreBatch(lag, rho_b, size, n - l - 1, 2*l + 1);
+		for (int j= 0; j < size; ++j) {
+			// l*log(0) is replaced by 0 for l == 0, and log(0) = -inf gives exp(-inf) = 0 otherwise
+			const float log_pow= l == 0 ? 0.0f : l*std::log(rho_b[j]);
+			const float log_mag= log_c + log_pow - 0.5f*rho_b[j] + std::log(std::abs(lag[j]));
+			const float mag= std::exp(log_mag);
+			result[begin + j]= lag[j] < 0.0f ? -mag : mag;
+		}
+	}
+}
+
+/// Associated Legendre function P(l, m, x) (with Condon-Shortley phase) for `count` arguments
+/// Starts from P_mm = (-1)^m*(2m - 1)!!*(1 - x^2)^(m/2) and uses the recurrence
+/// (l - m)P_l = (2l - 1)x*P_l-1 - (l + m - 1)P_l-2
+/// @note `result` may be the same array as `x`
+inline
+void associatedLegendreBatch(double* result, const double* x, int count, int l, int m)
+{
+	assert(m >= 0 && m <= l);
+	double pmm_factor= 1.0; // (-1)^m*(2m - 1)!!
+	for (int i= 1; i <= m; ++i)
+		pmm_factor *= -(2*i - 1);
+
+	for (int begin= 0; begin < count; begin += batchBlockSize) {
+		const int size= count - begin < batchBlockSize ? count - begin : batchBlockSize;
+		const double* xb= x + begin;
+		double prev[batchBlockSize];
+		double cur[batchBlockSize];
+		for (int j= 0; j < size; ++j) {
+			const double sin_x= std::sqrt((1.0 - xb[j])*(1.0 + xb[j]));
+			double pmm= pmm_factor;
+			for (int i= 0; i < m; ++i)
+				pmm *= sin_x;
+			prev[j]= pmm;
+			cur[j]= (2*m + 1)*xb[j]*pmm; // P_m+1,m
+		}
+		if (l == m) {
+			for (int j= 0; j < size; ++j)
+				cur[j]= prev[j];
+		}
+		for (int ll= m + 2; ll <= l; ++ll) {
+			const double a= 2*ll - 1;
+			const double b= ll + m - 1;
+			const double inv= 1.0/(ll - m);
+			for (int j= 0; j < size; ++j) {
+				double next= (a*xb[j]*cur[j] - b*prev[j])*inv;
+				prev[j]= cur[j];
+				cur[j]= next;
+			}
+		}
+		for (int j= 0; j < size; ++j)
+			result[begin + j]= cur[j];
+	}
+}
+
+/// Spherical harmonic in Cartesian form (solid harmonic)
+///   r^l*Y(l, m) = (x +- iy)^|m|*z^p*sum_j coeff[j]*(z^2)^(K - j)*(r^2)^j,
+/// where K = (l - |m|)/2 rounded down, p = (l - |m|) mod 2, and the sign is the sign of m
+/// Real and imaginary parts are the real solid harmonics of cosine and sine type
+struct SolidHarmonic {
+	double coeff[maxPolyTermCount];
+	int l, m;
+};
+
+/// @param cos_coeff Coefficients from `sphericalHarmonics(cos_coeff, l, m)`
+constexpr SolidHarmonic createSolidHarmonic(const double* cos_coeff, int l, int m)
+{
+	// sin(theta)^|m|*e^(i*m*phi)*cos(theta)^i =
+	//   (x +- iy)^|m|*z^i*r^(l - |m| - i)/r^l, and only powers i of the same parity as l - |m| exist
+	SolidHarmonic h= {};
+	h.l= l;
+	h.m= m;
+	const int k= l - (m < 0 ? -m : m);
+	for (int j= 0; j <= k/2; ++j)
+		h.coeff[j]= cos_coeff[k - 2*j];
+	return h;
+}
+
+/// Evaluates r^l*Y(l, m) for `count` points using only polynomials of x, y and z
+inline
+void solidHarmonicsBatch(	Complex* result, const SolidHarmonic& h,
+							const double* x, const double* y, const double* z, int count)
+{
+	const int abs_m= h.m < 0 ? -h.m : h.m;
+	const double m_sign= h.m < 0 ? -1.0 : 1.0;
+	const int k= h.l - abs_m;
+	for (int begin= 0; begin < count; begin += batchBlockSize) {
+		const int size= count - begin < batchBlockSize ? count - begin : batchBlockSize;
+		const double* xb= x + begin;
+		const double* yb= y + begin;
+		const double* zb= z + begin;
+		double re[batchBlockSize];
+		double im[batchBlockSize];
+		double poly[batchBlockSize];
+		for (int j= 0; j < size; ++j) {
+			// (x +- iy)^|m|
+			double a= 1.0, b= 0.0;
+			for (int i= 0; i < abs_m; ++i) {
+				double a_next= a*xb[j] - b*m_sign*yb[j];
+				b= a*m_sign*yb[j] + b*xb[j];
+				a= a_next;
+			}
+			re[j]= a;
+			im[j]= b;
+
+			// Homogeneous polynomial of z^2 and r^2, Horner in z^2
+			const double z2= zb[j]*zb[j];
+			const double r2= xb[j]*xb[j] + yb[j]*yb[j] + z2;
+			double sum= h.coeff[0];
+			double r2_pow= 1.0;
+			for (int i= 1; i <= k/2; ++i) {
+				r2_pow *= r2;
+				sum= sum*z2 + h.coeff[i]*r2_pow;
+			}
+			poly[j]= k % 2 ? sum*zb[j] : sum;
+		}
+		for (int j= 0; j < size; ++j) {
+			result[begin + j].a= re[j]*poly[j];
+			result[begin + j].b= im[j]*poly[j];
+		}
+	}
+}
+
+/// Evaluates Y(l, m) for `count` points as r^-l times the solid harmonic
+/// Needs a square root per point, but no inverse trigonometry
+/// @note Y is undefined at the origin, where zero is returned for l > 0
+inline
+void sphericalHarmonicsBatch(	Complex* result, const SolidHarmonic& h,
+								const double* x, const double* y, const double* z, int count)
+{
+	solidHarmonicsBatch(result, h, x, y, z, count);
+	if (h.l == 0)
+		return;
+	for (int i= 0; i < count; ++i) {
+		const double r2= x[i]*x[i] + y[i]*y[i] + z[i]*z[i];
+		double scale= r2 > 0.0 ? 1.0/std::sqrt(r2) : 0.0;
+		double r_pow= 1.0;
+		for (int j= 0; j < h.l; ++j)
+			r_pow *= scale;
+		result[i].a *= r_pow;
+		result[i].b *= r_pow;
+	}
+}
+
 inline
 void testMath()
 {
@@ -158,6 +500,172 @@ void testMath()
 			}
 		}
 	}
+
+	{ // Precalculated tables
+		static_assert(fact(4) == 24, "Factorial table broken");
+		static_assert(binomial(10, 4) == 210, "Binomial table broken");
+		assert(fact(factTableSize + 1) == (factTableSize + 1)*fact(factTableSize));
+
+		for (int n= 1; n < maxPolyTermCount; ++n) {
+			for (int l= 0; l < n; ++l) {
+				double lag[maxPolyTermCount]= {};
+				double lag_table[maxPolyTermCount]= {};
+				laguerre(lag, n - l - 1, 2*l + 1);
+				hydrogenLaguerre(lag_table, n, l);
+				for (int i= 0; i < maxPolyTermCount; ++i)
+					assert(lag[i] == lag_table[i]);
+			}
+		}
+
+		for (int l= 0; l < maxPolyTermCount; ++l) {
+			for (int m= -l; m <= l; ++m) {
+				double sphe[maxPolyTermCount]= {};
+				double sphe_table[maxPolyTermCount]= {};
+				sphericalHarmonics(sphe, l, m);
+				sphericalHarmonicsLookup(sphe_table, l, m);
+				for (int i= 0; i < maxPolyTermCount; ++i)
+					assert(std::abs(sphe[i] - sphe_table[i]) <= 1e-12*std::abs(sphe[i]));
+			}
+		}
+	}
+
+	{ // Batch evaluation with recurrences
+		const int count= 100;
+		double x[count];
+		double batch[count];
+
+		for (int n= 0; n < 12; ++n) {
+			for (int alpha= 1; alpha < 24; alpha += 2) {
+				double coeff[maxPolyTermCount]= {};
+				laguerre(coeff, n, alpha);
+				for (int i= 0; i < count; ++i)
+					x[i]= 0.2*i;
+				laguerreBatch(batch, x, count, n, alpha);
+				for (int i= 0; i < count; ++i) {
+					double sum= 0.0;
+					for (int k= n; k >= 0; --k)
+						sum= sum*x[i] + coeff[k];
+					assert(std::abs(batch[i] - sum) <= 1e-6*(1.0 + std::abs(sum)));
+				}
+			}
+		}
+
+		for (int l= 0; l < 12; ++l) {
+			for (int m= -l; m <= l; ++m) {
+				double coeff[maxPolyTermCount]= {};
+				sphericalHarmonics(coeff, l, m);
+				const int abs_m= std::abs(m);
+				for (int i= 0; i < count; ++i)
+					x[i]= std::cos(pi*i/count);
+				associatedLegendreBatch(batch, x, count, l, abs_m);
+				for (int i= 0; i < count; ++i) {
+					double sum= 0.0;
+					for (int k= l; k >= 0; --k)
+						sum= sum*x[i] + coeff[k];
+					sum *= std::pow(std::sin(pi*i/count), abs_m);
+					double value= sphericalHarmonicsLegendreFactor(l, m)*batch[i];
+					assert(std::abs(value - sum) < 1e-6);
+				}
+			}
+		}
+	}
+
+	{ // Radial evaluation in float32
+		const int count= 200;
+		float rho[count];
+		float radial[count];
+		double rho_d[count];
+		double lag[count];
+		for (int i= 0; i < count; ++i) {
+			rho[i]= 0.5f*i;
+			rho_d[i]= rho[i];
+		}
+		for (int n= 1; n <= 12; ++n) {
+			for (int l= 0; l < n; ++l) {
+				const double c= 1e-12 + 1e-3*l;
+				hydrogenRadialBatch(radial, rho, count, n, l, c);
+				laguerreBatch(lag, rho_d, count, n - l - 1, 2*l + 1);
+				double peak= 0.0;
+				for (int i= 0; i < count; ++i) {
+					lag[i] *= c*std::pow(rho_d[i], l)*std::exp(-0.5*rho_d[i]);
+					peak= std::abs(lag[i]) > peak ? std::abs(lag[i]) : peak;
+				}
+				for (int i= 0; i < count; ++i)
+					assert(std::abs(radial[i] - lag[i]) <= 1e-5*peak);
+			}
+		}
+	}
+
+	{ // Cartesian spherical harmonics
+		const int count= 50;
+		double x[count], y[count], z[count];
+		Complex cartesian[count];
+		for (int i= 0; i < count; ++i) {
+			const double r= 0.1 + 0.3*i;
+			const double theta= pi*(i + 0.5)/count;
+			const double phi= 0.37*i;
+			x[i]= r*std::sin(theta)*std::cos(phi);
+			y[i]= r*std::sin(theta)*std::sin(phi);
+			z[i]= r*std::cos(theta);
+		}
+
+		for (int l= 0; l < 10; ++l) {
+			for (int m= -l; m <= l; ++m) {
+				double coeff[maxPolyTermCount]= {};
+				sphericalHarmonics(coeff, l, m);
+				SolidHarmonic h= createSolidHarmonic(coeff, l, m);
+				sphericalHarmonicsBatch(cartesian, h, x, y, z, count);
+				for (int i= 0; i < count; ++i) {
+					const double theta= pi*(i + 0.5)/count;
+					const double phi= 0.37*i;
+					double sum= 0.0;
+					for (int k= l; k >= 0; --k)
+						sum= sum*std::cos(theta) + coeff[k];
+					sum *= std::pow(std::sin(theta), std::abs(m));
+					assert(std::abs(cartesian[i].a - sum*std::cos(m*phi)) < 1e-6);
+					assert(std::abs(cartesian[i].b - sum*std::sin(m*phi)) < 1e-6);
+				}
+			}
+		}
+	}
+
+	{ // Complex batches
+		ComplexBatch<7> c1, c2, product;
+		c1.size= c2.size= 7;
+		double weights[7];
+		Complex correct_sum= {};
+		for (int i= 0; i < 7; ++i) {
+			Complex v1= { 0.5*i, 1.0 - i }, v2= { 2.0 + i, -0.25*i };
+			set(c1, i, v1);
+			set(c2, i, v2);
+			weights[i]= 1.0 + i;
+			Complex v= v1*conj(v2);
+			correct_sum.a += v.a*weights[i];
+			correct_sum.b += v.b*weights[i];
+		}
+		conj(c2);
+		mul(product, c1, c2);
+		const Complex sum= accumulate(product, weights);
+		assert(std::abs(sum.a - correct_sum.a) < 1e-12);
+		assert(std::abs(sum.b - correct_sum.b) < 1e-12);
+	}
+
+	{ // Matrices
+		const float a= 0.7f, b= -0.3f, r= 5.0f;
+		const float s1= std::sin(a), s2= std::sin(b);
+		const float c1= std::cos(a), c2= std::cos(b);
+		const float correct[16]= {
+			c1,			0,		s1,		0,
+			-s1*s2,		c2,		c1*s2,	0,
+			-c2*s1,		-s2,	c2*c1,	0,
+			-c2*s1*r,	-s2*r,	c2*c1*r,1
+		};
+		float m[16];
+		(rotationYMat4f(-a)*rotationXMat4f(b)*translationMat4f(Vec3f(0, 0, r))).store(m);
+		for (int i= 0; i < 16; ++i)
+			assert(std::abs(m[i] - correct[i]) < 1e-5f);
+		assert(std::abs(Vec3f(1, 2, 2).length() - 3.0f) < 1e-6f);
+	}
 }
 
 } // qm
@@ -1,9 +1,12 @@
 //
 // Building
 //
+// A C++14 compiler is required (the default of recent GCC and Clang)
+//
 // On Linux
 // GCC: g++ -O2 source/unity.cpp -lGL -lX11 -o qm
 // Clang: clang++ -O2 source/unity.cpp -lGL -lX11 -o qm
+// (add -pthread with glibc older than 2.34)
 //
 // On Windows
 // MinGW: g++ -O2 source/unity.cpp -lOpenGL32 -lGdi32 -o qm.exe
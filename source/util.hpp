@@ -5,6 +5,9 @@
 #include <cmath>
 #include <cstdarg>
 #include <inttypes.h>
+#ifdef __SSE2__
+#	include <emmintrin.h>
+#endif
 
 namespace qm {
 
@@ -66,6 +69,299 @@ Complex operator*(Complex c1, Complex c2)
 	return c;
 }
 
+/// 4-component float vector, one SSE register when available
+struct Vec4f {
+#ifdef __SSE2__
+	__m128 v;
+
+	Vec4f(): v(_mm_setzero_ps()) {}
+	Vec4f(float x, float y, float z, float w): v(_mm_setr_ps(x, y, z, w)) {}
+	explicit Vec4f(__m128 v): v(v) {}
+
+	Vec4f operator*(float scalar) const { return Vec4f(_mm_mul_ps(v, _mm_set1_ps(scalar))); }
+	Vec4f operator*(Vec4f other) const { return Vec4f(_mm_mul_ps(v, other.v)); }
+	Vec4f operator+(Vec4f other) const { return Vec4f(_mm_add_ps(v, other.v)); }
+	Vec4f operator-(Vec4f other) const { return Vec4f(_mm_sub_ps(v, other.v)); }
+
+	void store(float* out) const { _mm_storeu_ps(out, v); }
+	float operator[](int i) const { float e[4]; store(e); return e[i]; }
+#else
+	float e[4];
+
+	Vec4f(): e() {}
+	Vec4f(float x, float y, float z, float w) { e[0]= x; e[1]= y; e[2]= z; e[3]= w; }
+
+	Vec4f operator*(float scalar) const { return Vec4f(e[0]*scalar, e[1]*scalar, e[2]*scalar, e[3]*scalar); }
+	Vec4f operator*(Vec4f o) const { return Vec4f(e[0]*o.e[0], e[1]*o.e[1], e[2]*o.e[2], e[3]*o.e[3]); }
+	Vec4f operator+(Vec4f o) const { return Vec4f(e[0]+o.e[0], e[1]+o.e[1], e[2]+o.e[2], e[3]+o.e[3]); }
+	Vec4f operator-(Vec4f o) const { return Vec4f(e[0]-o.e[0], e[1]-o.e[1], e[2]-o.e[2], e[3]-o.e[3]); }
+
+	void store(float* out) const { for (int i= 0; i < 4; ++i) out[i]= e[i]; }
+	float operator[](int i) const { return e[i]; }
+#endif
+
+	Vec4f& operator*=(float scalar) { return *this= *this*scalar; }
+	Vec4f& operator*=(Vec4f other) { return *this= *this*other; }
+	Vec4f& operator+=(Vec4f other) { return *this= *this+other; }
+	Vec4f& operator-=(Vec4f other) { return *this= *this-other; }
+};
+
+inline
+float dot(Vec4f a, Vec4f b)
+{
+	const Vec4f p= a*b;
+	return (p[0] + p[1]) + (p[2] + p[3]);
+}
+
+/// 3-component float vector, stored as Vec4f with w= 0
+struct Vec3f {
+	Vec4f v;
+
+	Vec3f() {}
+	Vec3f(float x, float y, float z): v(x, y, z, 0) {}
+	explicit Vec3f(Vec4f v): v(v) {}
+
+	float x() const { return v[0]; }
+	float y() const { return v[1]; }
+	float z() const { return v[2]; }
+
+	float lengthSqr() const { return dot(v, v); }
+	float length() const { return std::sqrt(lengthSqr()); }
+
+	Vec3f operator*(float scalar) const { return Vec3f(v*scalar); }
+	Vec3f operator*(Vec3f other) const { return Vec3f(v*other.v); }
+	Vec3f operator+(Vec3f other) const { return Vec3f(v + other.v); }
+	Vec3f operator-(Vec3f other) const { return Vec3f(v - other.v); }
+
+	Vec3f& operator*=(float scalar) { return *this= *this*scalar; }
+	Vec3f& operator+=(Vec3f other) { return *this= *this+other; }
+	Vec3f& operator-=(Vec3f other) { return *this= *this-other; }
+};
+
+inline
+float dot(Vec3f a, Vec3f b)
+{ return dot(a.v, b.v); }
+
+/// Column-major 4x4 float matrix, layout compatible with glUniformMatrix4fv
+struct Mat4f {
+	Vec4f col[4];
+
+	Vec4f operator*(Vec4f v) const
+	{
+		return col[0]*v[0] + col[1]*v[1] + col[2]*v[2] + col[3]*v[3];
+	}
+
+	Mat4f operator*(const Mat4f& other) const
+	{
+		Mat4f m;
+		for (int i= 0; i < 4; ++i)
+			m.col[i]= *this*other.col[i];
+		return m;
+	}
+
+	void store(float* out) const
+	{
+		for (int i= 0; i < 4; ++i)
+			col[i].store(out + 4*i);
+	}
+};
+
+inline
+Mat4f identityMat4f()
+{
+	Mat4f m;
+	m.col[0]= Vec4f(1, 0, 0, 0);
+	m.col[1]= Vec4f(0, 1, 0, 0);
+	m.col[2]= Vec4f(0, 0, 1, 0);
+	m.col[3]= Vec4f(0, 0, 0, 1);
+	return m;
+}
+
+inline
+Mat4f translationMat4f(Vec3f t)
+{
+	Mat4f m= identityMat4f();
+	m.col[3]= Vec4f(t.x(), t.y(), t.z(), 1);
+	return m;
+}
+
+/// Right-handed rotation around x-axis
+inline
+Mat4f rotationXMat4f(float angle)
+{
+	const float s= std::sin(angle), c= std::cos(angle);
+	Mat4f m= identityMat4f();
+	m.col[1]= Vec4f(0, c, s, 0);
+	m.col[2]= Vec4f(0, -s, c, 0);
+	return m;
+}
+
+/// Right-handed rotation around y-axis
+inline
+Mat4f rotationYMat4f(float angle)
+{
+	const float s= std::sin(angle), c= std::cos(angle);
+	Mat4f m= identityMat4f();
+	m.col[0]= Vec4f(c, 0, -s, 0);
+	m.col[2]= Vec4f(s, 0, c, 0);
+	return m;
+}
+
+/// Structure-of-arrays complex numbers, for kernels which process many values at once
+/// Real and imaginary parts are in separate arrays so that operations map to packed lanes
+template <std::size_t Size>
+struct ComplexBatch {
+	alignas(16) double a[Size];
+	alignas(16) double b[Size];
+	std::size_t size;
+};
+
+template <std::size_t Size>
+Complex get(const ComplexBatch<Size>& c, std::size_t i)
+{
+	assert(i < c.size);
+	Complex value= { c.a[i], c.b[i] };
+	return value;
+}
+
+template <std::size_t Size>
+void set(ComplexBatch<Size>& c, std::size_t i, Complex value)
+{
+	assert(i < c.size);
+	c.a[i]= value.a;
+	c.b[i]= value.b;
+}
+
+/// result = c1*c2, elementwise. `result` may alias the arguments
+template <std::size_t Size>
+void mul(ComplexBatch<Size>& result, const ComplexBatch<Size>& c1, const ComplexBatch<Size>& c2)
+{
+	assert(c1.size == c2.size);
+	std::size_t i= 0;
+#ifdef __SSE2__
+	for (; i + 2 <= c1.size; i += 2) {
+		const __m128d a1= _mm_load_pd(c1.a + i), b1= _mm_load_pd(c1.b + i);
+		const __m128d a2= _mm_load_pd(c2.a + i), b2= _mm_load_pd(c2.b + i);
+		_mm_store_pd(result.a + i, _mm_sub_pd(_mm_mul_pd(a1, a2), _mm_mul_pd(b1, b2)));
+		_mm_store_pd(result.b + i, _mm_add_pd(_mm_mul_pd(a1, b2), _mm_mul_pd(b1, a2)));
+	}
+#endif
+	for (; i < c1.size; ++i) {
+		const double a= c1.a[i]*c2.a[i] - c1.b[i]*c2.b[i];
+		const double b= c1.a[i]*c2.b[i] + c1.b[i]*c2.a[i];
+		result.a[i]= a;
+		result.b[i]= b;
+	}
+	result.size= c1.size;
+}
+
+/// c = conj(c), elementwise
+template <std::size_t Size>
+void conj(ComplexBatch<Size>& c)
+{
+	for (std::size_t i= 0; i < c.size; ++i)
+		c.b[i]= -c.b[i];
+}
+
+/// Sum of c[i]*weights[i], with weights of length c.size
+template <std::size_t Size>
+Complex accumulate(const ComplexBatch<Size>& c, const double* weights)
+{
+	std::size_t i= 0;
+	Complex sum= {};
+#ifdef __SSE2__
+	__m128d sum_a= _mm_setzero_pd(), sum_b= _mm_setzero_pd();
+	for (; i + 2 <= c.size; i += 2) {
+		const __m128d w= _mm_loadu_pd(weights + i);
+		sum_a= _mm_add_pd(sum_a, _mm_mul_pd(_mm_load_pd(c.a + i), w));
+		sum_b= _mm_add_pd(sum_b, _mm_mul_pd(_mm_load_pd(c.b + i), w));
+	}
+	double lanes[2];
+	_mm_storeu_pd(lanes, sum_a);
+	sum.a= lanes[0] + lanes[1];
+	_mm_storeu_pd(lanes, sum_b);
+	sum.b= lanes[0] + lanes[1];
+#endif
+	for (; i < c.size; ++i) {
+		sum.a += c.a[i]*weights[i];
+		sum.b += c.b[i]*weights[i];
+	}
+	return sum;
+}
+
+/// Sum of c[i]
+template <std::size_t Size>
+Complex accumulate(const ComplexBatch<Size>& c)
+{
+	std::size_t i= 0;
+	Complex sum= {};
+#ifdef __SSE2__
+	__m128d sum_a= _mm_setzero_pd(), sum_b= _mm_setzero_pd();
+	for (; i + 2 <= c.size; i += 2) {
+		sum_a= _mm_add_pd(sum_a, _mm_load_pd(c.a + i));
+		sum_b= _mm_add_pd(sum_b, _mm_load_pd(c.b + i));
+	}
+	double lanes[2];
+	_mm_storeu_pd(lanes, sum_a);
+	sum.a= lanes[0] + lanes[1];
+	_mm_storeu_pd(lanes, sum_b);
+	sum.b= lanes[0] + lanes[1];
+#endif
+	for (; i < c.size; ++i) {
+		sum.a += c.a[i];
+		sum.b += c.b[i];
+	}
+	return sum;
+}
+
+/// 64-bit FNV-1a hash. Pass the previous result as `hash` to hash data in pieces
+inline
+uint64_t hashFnv1a(const void* data, std::size_t size, uint64_t hash= 14695981039346656037ULL)
+{
+	const unsigned char* bytes= (const unsigned char*)data;
+	for (std::size_t i= 0; i < size; ++i) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/// PCG32 random number generator (O'Neill 2014)
+/// Generators with different `stream` produce independent sequences from the same seed
+struct Rng {
+	uint64_t state;
+	uint64_t inc;
+};
+
+inline
+uint32_t random32(Rng& rng)
+{
+	const uint64_t old= rng.state;
+	rng.state= old*6364136223846793005ULL + rng.inc;
+	const uint32_t xorshifted= (uint32_t)(((old >> 18) ^ old) >> 27);
+	const uint32_t rot= (uint32_t)(old >> 59);
+	return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+}
+
+inline
+Rng createRng(uint64_t seed, uint64_t stream)
+{
+	Rng rng= { 0, (stream << 1) | 1 };
+	random32(rng);
+	rng.state += seed;
+	random32(rng);
+	return rng;
+}
+
+/// Uniform in [0, 1) with 53 random bits
+inline
+double randomDouble(Rng& rng)
+{
+	const uint64_t high= random32(rng);
+	const uint64_t bits= (high << 21) | (random32(rng) >> 11);
+	return bits*(1.0/(1ULL << 53));
+}
+
 inline
 Vec2f fitToGrid(Vec2f v, Vec2i reso)
 {
@@ -98,6 +394,7 @@ void append(StackString<Size>& s, const char* format, ...)
 struct String {
 	char* str;
 	std::size_t length;
+	std::size_t capacity; // Including null terminator
 };
 
 inline
@@ -105,6 +402,7 @@ String createString()
 {
 	String s= {};
 	s.str= (char*)std::calloc(1, 1);
+	s.capacity= 1;
 	return s;
 }
 
@@ -127,11 +425,16 @@ void append(String* s, const char* format, ...)
 	va_copy(args2, args);
 
 	std::size_t new_len= s->length + std::vsnprintf(NULL, 0, format, args);
-	s->str= (char*)std::realloc((void*)s->str, new_len + 1);
-	assert(s->str);
-	std::vsnprintf(s->str + s->length, new_len + 1, format, args2);
+	if (new_len + 1 > s->capacity) {
+		// Geometric growth keeps appending many small pieces linear
+		s->capacity= s->capacity*2 > new_len + 1 ? s->capacity*2 : new_len + 1;
+		s->str= (char*)std::realloc((void*)s->str, s->capacity);
+		assert(s->str);
+	}
+	std::vsnprintf(s->str + s->length, new_len + 1 - s->length, format, args2);
 	s->length= new_len;
 
+	va_end(args2);
 	va_end(args);
 }
 